@@ -896,6 +896,7 @@
 #define USB_DEVICE_ID_MS_SURFACE3_COVER		0x07de
 #define USB_DEVICE_ID_MS_XBOX_ONE_S_CONTROLLER	0x02fd
 #define USB_DEVICE_ID_MS_XBOX_SERIES_X_CONTROLLER  0x0B13
+#define USB_DEVICE_ID_MS_XBOX_ELITE_2_CONTROLLER  0x0B05
 #define USB_DEVICE_ID_MS_PIXART_MOUSE    0x00cb
 #define USB_DEVICE_ID_8BITDO_SN30_PRO_PLUS      0x02e0
 
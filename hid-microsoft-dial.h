@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Surface Dial rotation to scroll wheel conversion, plain C so the
+ *  tools/ test can build it as well
+ */
+
+#ifndef HID_MICROSOFT_DIAL_H_FILE
+#define HID_MICROSOFT_DIAL_H_FILE
+
+/*
+ * Partial detents carried over to the next report, with the sign of the
+ * rotation they came from, clockwise being positive.
+ */
+struct ms_dial_remainder {
+	int hires;	/* dial units * 120 */
+	int wheel;	/* REL_WHEEL_HI_RES units */
+};
+
+/*
+ * Turn @value dial units into REL_WHEEL_HI_RES steps, 120 per detent, and
+ * REL_WHEEL steps, clockwise scrolling down. Partial detents are dropped
+ * when the direction changes.
+ */
+static inline void ms_dial_rotate(struct ms_dial_remainder *r, int value,
+		int units_per_detent, int *hires, int *wheel)
+{
+	if ((r->hires && (value > 0) != (r->hires > 0)) ||
+	    (r->wheel && (value > 0) != (r->wheel > 0))) {
+		r->hires = 0;
+		r->wheel = 0;
+	}
+
+	/* division truncates, the remainders keep their sign */
+	r->hires += value * 120;
+	*hires = r->hires / units_per_detent;
+	r->hires -= *hires * units_per_detent;
+
+	r->wheel += *hires;
+	*wheel = r->wheel / 120;
+	r->wheel -= *wheel * 120;
+
+	*hires = -*hires;
+	*wheel = -*wheel;
+}
+
+#endif
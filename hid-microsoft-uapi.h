@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ *  User space interface of hid-microsoft
+ */
+
+#ifndef _UAPI_HID_MICROSOFT_H
+#define _UAPI_HID_MICROSOFT_H
+
+#include <linux/types.h>
+
+/*
+ * Xbox controller state page
+ *
+ * With the state_page module parameter set, every Xbox controller the
+ * driver decodes itself gets a /dev/ms-gamepad<n> node, a child of its
+ * input device. Mapping its first page read-only gives a struct
+ * ms_gamepad_state_page that the driver updates for each input report.
+ *
+ * The block is written like a seqcount: seq is odd while an update is in
+ * progress. Readers copy the block and retry until they saw the same,
+ * even, seq before and after the copy:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+ *		copy = *page;
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != __atomic_load_n(&page->seq,
+ *						     __ATOMIC_RELAXED));
+ *
+ * The mapping stays valid across reconnects of the controller when
+ * reconnect_grace_ms keeps its input device around; connected tells
+ * whether the values are live.
+ */
+
+#define MS_GAMEPAD_STATE_VERSION	2
+
+/* bits of ms_gamepad_state_page.buttons */
+#define MS_GAMEPAD_BTN_A		0
+#define MS_GAMEPAD_BTN_B		1
+#define MS_GAMEPAD_BTN_X		3
+#define MS_GAMEPAD_BTN_Y		4
+#define MS_GAMEPAD_BTN_LB		6
+#define MS_GAMEPAD_BTN_RB		7
+#define MS_GAMEPAD_BTN_VIEW		10
+#define MS_GAMEPAD_BTN_MENU		11
+#define MS_GAMEPAD_BTN_GUIDE		12
+#define MS_GAMEPAD_BTN_LSTICK		13
+#define MS_GAMEPAD_BTN_RSTICK		14
+#define MS_GAMEPAD_BTN_SHARE		15	/* Series X|S */
+
+/* ms_gamepad_state_page.axes, sticks 0..65535, triggers 0..1023 */
+#define MS_GAMEPAD_AXIS_LX		0
+#define MS_GAMEPAD_AXIS_LY		1
+#define MS_GAMEPAD_AXIS_RX		2
+#define MS_GAMEPAD_AXIS_RY		3
+#define MS_GAMEPAD_AXIS_LT		4
+#define MS_GAMEPAD_AXIS_RT		5
+#define MS_GAMEPAD_AXES			6
+
+struct ms_gamepad_state_page {
+	__u32 seq;
+	__u32 version;		/* MS_GAMEPAD_STATE_VERSION */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of the report */
+	__u64 report_seq;	/* input reports seen since creation */
+	__u16 axes[MS_GAMEPAD_AXES];
+	__u16 buttons;
+	__u8 hat;		/* 0 centered, 1..8 north clockwise */
+	__u8 connected;
+	/* version 2, Elite Series 2 only */
+	__u8 paddles;		/* bit n is paddle P<n + 1> */
+	__u8 profile;		/* 0 default, 1..3 the profile LEDs */
+	__u16 reserved;
+};
+
+/*
+ * Streaming haptics
+ *
+ * With the haptics_stream module parameter set, every device with rumble
+ * gets a /dev/ms-haptics<n> node, a child of its HID device. Its first
+ * page maps read-write to a struct ms_haptics_ring: a single producer
+ * ring of motor frames, each played at its CLOCK_MONOTONIC time.
+ *
+ * The producer fills frames[head % MS_HAPTICS_FRAMES] and then publishes
+ * it with a release store of head + 1, as long as head - tail stays below
+ * MS_HAPTICS_FRAMES. The driver wakes up when the oldest queued frame is
+ * due, plays the newest frame that is due and skips the ones before it.
+ * A frame more than MS_HAPTICS_LATE_NS past its time is not played
+ * either. Both count as dropped.
+ *
+ * With nothing queued the driver sets idle and sleeps. After publishing,
+ * the producer issues a full barrier, reads idle and, if it is set,
+ * writes anything to the node to wake the driver.
+ *
+ * A frame keeps playing until the next one, the motors are stopped when
+ * the last file of the node is closed. While the node is open it owns
+ * the motors: rumble effects played through the input device and rumble
+ * group triggers are not sent to the device.
+ */
+
+#define MS_HAPTICS_VERSION		2
+#define MS_HAPTICS_FRAMES		128
+#define MS_HAPTICS_LATE_NS		2000000
+
+/* magnitudes in percent, 0..100 */
+struct ms_haptics_frame {
+	__u64 time_ns;
+	__u8 strong;		/* left grip motor */
+	__u8 weak;		/* right grip motor */
+	__u8 left_trigger;
+	__u8 right_trigger;
+	__u32 reserved;
+};
+
+struct ms_haptics_ring {
+	__u32 version;		/* MS_HAPTICS_VERSION */
+	__u32 head;		/* written by the producer */
+	__u32 tail;		/* written by the driver */
+	__u32 idle;		/* written by the driver, see above */
+	__u64 played;
+	__u64 dropped;
+	struct ms_haptics_frame frames[MS_HAPTICS_FRAMES];
+};
+
+#endif /* _UAPI_HID_MICROSOFT_H */
@@ -1,18 +1,92 @@
 // SPDX-License-Identifier: GPL-2.0+
 
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
 #include <linux/input.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/suspend.h>
 
 #include "hid-ids.h"
+#include "hid-microsoft-xbox.h"
 
 #define XBOX_SERIES_XS BIT(0)
+#define XBOX_ELITE_2 BIT(1)
+
+static char *connect[8];
+static int connect_count;
+module_param_array(connect, charp, &connect_count, 0644);
+MODULE_PARM_DESC(connect, "Interfaces to connect per device, <vid>:<pid>:<iface>[+<iface>...] with iface input, hidraw, hiddev, ff or none (applies on probe)");
+
+static bool system_buttons;
+module_param(system_buttons, bool, 0644);
+MODULE_PARM_DESC(system_buttons, "Report Guide and Share on an input device of their own (applies on probe)");
+
+static const unsigned int microsoft_xbox_sys_keys[] = { BTN_MODE, KEY_RECORD };
 
 struct microsoft_xbox_sc {
 	unsigned long quirks;
+	struct dentry *debugfs;
+
+	/*
+	 * While no input device is open the input report is passed on to
+	 * hidraw and kept, hid-core doesn't parse it. The kept report is
+	 * replayed once somebody listens again. With hiddev connected
+	 * hid-core parses it and only its events are dropped.
+	 */
+	spinlock_t lock;	/* protects opened, the idle report and
+				 * burst, serialises replays */
+	unsigned int opened;
+	bool stale;		/* events were dropped since the last replay */
+	u8 *idle_report;
+	unsigned int idle_len;
+	bool idle_kept;		/* idle_report is newer than the fields */
+
+	/* Guide as button 13 (BIT(0)) and as AC Home (BIT(1)) */
+	unsigned int guide;
+
+	/* Guide and Share on an input device of their own */
+	struct input_dev *sys_input;
+	char sys_name[144];
+
+	/* upper bound of the events of one input report */
+	unsigned int events_per_report;
+	struct xbox_burst_stats burst;
+
+	/*
+	 * Probe phases, connect to first input report and the last resume
+	 * to the first input report after it, in ns.
+	 */
+	u64 probe_start;
+	u64 parse_ns;
+	u64 hw_start_ns;
+	u64 probe_ns;
+	u64 first_event_ns;
+	u64 resume_start;	/* 0 once an event arrived */
+	u64 resume_first_event_ns;
+	unsigned int resumes;
+	struct notifier_block pm_nb;
 };
 
+static __u8 *microsoft_xbox_report_fixup(struct hid_device *hdev, __u8 *rdesc,
+				 unsigned int *rsize)
+{
+	const struct xbox_rdesc *x = xbox_rdesc_match(hdev, rdesc, *rsize);
+
+	/* firmware specific descriptor with a known layout */
+	if (x) {
+		hid_info(hdev, "replacing %u byte report descriptor with canonical Xbox descriptor\n",
+			 *rsize);
+		*rsize = x->size;
+		return (__u8 *)x->rdesc;
+	}
+
+	return rdesc;
+}
 
 #define microsoft_xbox_map_abs_usage_clear(c) hid_map_usage_clear(hi, usage, bit, max, EV_ABS, (c))
 static int xbox_series_xs_mapping(struct hid_device *hdev, struct hid_input *hi,
@@ -39,24 +113,526 @@ static int xbox_series_xs_mapping(struct hid_device *hdev, struct hid_input *hi,
 	return 1;
 }
 
+/* paddles P1-P4 and the profile switch of the canonical descriptor */
+static int xbox_elite_2_mapping(struct hid_device *hdev, struct hid_input *hi,
+				 struct hid_field *field, struct hid_usage *usage,
+				 unsigned long **bit, int *max)
+{
+	unsigned int button = usage->hid & HID_USAGE;
+
+	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_BUTTON &&
+	    button >= XBOX_PADDLE_USAGE &&
+	    button < XBOX_PADDLE_USAGE + XBOX_PADDLES) {
+		hid_map_usage_clear(hi, usage, bit, max, EV_KEY,
+				    BTN_TRIGGER_HAPPY5 + button - XBOX_PADDLE_USAGE);
+		return 1;
+	}
+
+	if (usage->hid == (HID_UP_MSVENDOR | 0x01)) {
+		microsoft_xbox_map_abs_usage_clear(ABS_PROFILE);
+		return 1;
+	}
+
+	return 0;
+}
+
 static int microsoft_xbox_input_mapping(struct hid_device *hdev, struct hid_input *hi,
 				 struct hid_field *field, struct hid_usage *usage,
 				 unsigned long **bit, int *max)
 {
 	struct microsoft_xbox_sc *sc = hid_get_drvdata(hdev);
 
+	/* Guide in Windows mode, see XBOX_RDESC_HOME */
+	if (usage->hid == (HID_UP_CONSUMER | 0x0223)) {
+		hid_map_usage_clear(hi, usage, bit, max, EV_KEY, BTN_MODE);
+		return 1;
+	}
+
 	if (sc->quirks & XBOX_SERIES_XS) {
 		return xbox_series_xs_mapping(hdev, hi, field, usage, bit, max);
 	}
 
+	if (sc->quirks & XBOX_ELITE_2)
+		return xbox_elite_2_mapping(hdev, hi, field, usage, bit, max);
+
 	/* let hid-core decide for the others */
 	return 0;
 }
 
+static int microsoft_xbox_raw_event(struct hid_device *hdev,
+				    struct hid_report *report, u8 *data, int size)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	unsigned long flags;
+	unsigned int len;
+	bool idle;
+
+	if (unlikely(!xsc->first_event_ns))
+		xsc->first_event_ns = ktime_get_ns() - xsc->probe_start;
+
+	if (unlikely(READ_ONCE(xsc->resume_start))) {
+		xsc->resume_first_event_ns = ktime_get_ns() - xsc->resume_start;
+		WRITE_ONCE(xsc->resume_start, 0);
+	}
+
+	if (report->id != XBOX_INPUT_REPORT)
+		return 0;
+
+	spin_lock_irqsave(&xsc->lock, flags);
+	idle = !xsc->opened && xsc->idle_report &&
+		(hdev->claimed & HID_CLAIMED_INPUT) &&
+		!(hdev->claimed & HID_CLAIMED_HIDDEV);
+	if (idle) {
+		len = min_t(unsigned int, size, xsc->idle_len);
+		memcpy(xsc->idle_report, data, len);
+		/* hid-core zero pads a short report as well */
+		memset(xsc->idle_report + len, 0, xsc->idle_len - len);
+		xsc->idle_kept = true;
+	} else if (xsc->opened && xsc->events_per_report) {
+		xbox_burst_account(&xsc->burst, xsc->events_per_report + 1);
+	}
+	spin_unlock_irqrestore(&xsc->lock, flags);
+
+	if (!idle)
+		return 0;
+
+	/* hid-core stops at the negative return, hidraw still gets it */
+	if (hdev->claimed & HID_CLAIMED_HIDRAW)
+		hidraw_report_event(hdev, data, size);
+
+	return -1;
+}
+
+static int microsoft_xbox_event(struct hid_device *hdev, struct hid_field *field,
+				struct hid_usage *usage, __s32 value);
+
+/* hat switch direction to axes, as hid-input maps it */
+static const struct {
+	__s32 x;
+	__s32 y;
+} microsoft_xbox_hat[] = {
+	{ 0, 0 }, { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 },
+	{ -1, 1 }, { -1, 0 }, { -1, -1 },
+};
+
+/*
+ * Store the variable fields of the kept idle report the way hid-core
+ * would have. Called with xsc->lock held.
+ */
+static void microsoft_xbox_fetch(struct hid_device *hdev,
+				 struct hid_report *report, u8 *data)
+{
+	struct hid_field *field;
+	unsigned int i, n;
+	__u32 value;
+
+	if (report->id)
+		data++;
+
+	for (i = 0; i < report->maxfield; i++) {
+		field = report->field[i];
+		if (!(field->flags & HID_MAIN_ITEM_VARIABLE))
+			continue;
+
+		for (n = 0; n < field->report_count; n++) {
+			value = hid_field_extract(hdev, data,
+					field->report_offset +
+					n * field->report_size,
+					field->report_size);
+			if (field->logical_minimum < 0)
+				value = sign_extend32(value,
+						      field->report_size - 1);
+			field->value[n] = value;
+		}
+	}
+}
+
+/*
+ * Send the last input report to the input devices, the kept idle report
+ * or the values hid-core stored. Called with xsc->lock held.
+ */
+static void microsoft_xbox_replay(struct hid_device *hdev)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	struct hid_report *report;
+	struct hid_field *field;
+	struct hid_usage *usage;
+	struct input_dev *input, *last = NULL;
+	unsigned int i, n;
+	__s32 value;
+	int dir;
+
+	report = hdev->report_enum[HID_INPUT_REPORT].report_id_hash[XBOX_INPUT_REPORT];
+	if (!report)
+		return;
+
+	if (xsc->idle_kept) {
+		microsoft_xbox_fetch(hdev, report, xsc->idle_report);
+		xsc->idle_kept = false;
+	}
+
+	for (i = 0; i < report->maxfield; i++) {
+		field = report->field[i];
+		if (!field->hidinput || !(field->flags & HID_MAIN_ITEM_VARIABLE))
+			continue;
+
+		input = field->hidinput->input;
+		if (last && last != input)
+			input_sync(last);
+		last = input;
+
+		for (n = 0; n < field->report_count; n++) {
+			usage = &field->usage[n];
+			value = field->value[n];
+
+			if (microsoft_xbox_event(hdev, field, usage, value))
+				continue;
+
+			if (usage->hat_min < usage->hat_max) {
+				dir = (value - usage->hat_min) * 8 /
+					(usage->hat_max - usage->hat_min + 1) + 1;
+				if (dir < 0 || dir > 8)
+					dir = 0;
+				input_event(input, usage->type, usage->code,
+					    microsoft_xbox_hat[dir].x);
+				input_event(input, usage->type, usage->code + 1,
+					    microsoft_xbox_hat[dir].y);
+			} else if (usage->type == EV_KEY || usage->type == EV_ABS) {
+				input_event(input, usage->type, usage->code,
+					    value);
+			}
+		}
+	}
+
+	if (last)
+		input_sync(last);
+}
+
+/* catch up on the events dropped while nobody listened */
+static void microsoft_xbox_report(struct hid_device *hdev,
+				  struct hid_report *report)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	unsigned long flags;
+
+	if (report->id != XBOX_INPUT_REPORT || !READ_ONCE(xsc->stale))
+		return;
+
+	spin_lock_irqsave(&xsc->lock, flags);
+	if (xsc->stale && xsc->opened) {
+		xsc->stale = false;
+		microsoft_xbox_replay(hdev);
+	}
+	spin_unlock_irqrestore(&xsc->lock, flags);
+}
+
+static int microsoft_xbox_input_open(struct input_dev *input)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	unsigned long flags;
+	int ret;
+
+	ret = hid_hw_open(hdev);
+	if (ret)
+		return ret;
+
+	/*
+	 * Bring the input devices up to date. A report being parsed right
+	 * now may not have stored its values yet, so leave stale set for
+	 * microsoft_xbox_report() to replay once more.
+	 */
+	spin_lock_irqsave(&xsc->lock, flags);
+	if (!xsc->opened++) {
+		xsc->stale = true;
+		microsoft_xbox_replay(hdev);
+	}
+	spin_unlock_irqrestore(&xsc->lock, flags);
+
+	return 0;
+}
+
+static void microsoft_xbox_input_close(struct input_dev *input)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&xsc->lock, flags);
+	xsc->opened--;
+	spin_unlock_irqrestore(&xsc->lock, flags);
+
+	hid_hw_close(hdev);
+}
+
+/*
+ * Guide is pressed while either of its usages is. The system buttons go
+ * to their own input device, synced when they change.
+ */
+static int microsoft_xbox_event(struct hid_device *hdev, struct hid_field *field,
+				struct hid_usage *usage, __s32 value)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	struct input_dev *input;
+	unsigned int bit;
+
+	/* nobody listens, microsoft_xbox_replay() catches up later */
+	if (field->report->id == XBOX_INPUT_REPORT &&
+	    !READ_ONCE(xsc->opened)) {
+		WRITE_ONCE(xsc->stale, true);
+		return 1;
+	}
+
+	if (usage->type != EV_KEY ||
+	    (usage->code != BTN_MODE && usage->code != KEY_RECORD))
+		return 0;
+
+	if (usage->code == BTN_MODE) {
+		bit = usage->hid == (HID_UP_CONSUMER | 0x0223) ? BIT(1) : BIT(0);
+		if (value)
+			xsc->guide |= bit;
+		else
+			xsc->guide &= ~bit;
+		value = !!xsc->guide;
+	}
+
+	/* cleared under xsc->lock before it is unregistered */
+	input = xsc->sys_input;
+	if (!input) {
+		if (usage->code == KEY_RECORD)
+			return 0;
+		/* synced by hid-core with the rest of the report */
+		input_report_key(field->hidinput->input, BTN_MODE, value);
+		return 1;
+	}
+
+	if (!!test_bit(usage->code, input->key) != !!value) {
+		input_report_key(input, usage->code, value);
+		input_sync(input);
+	}
+
+	return 1;
+}
+
+static int microsoft_xbox_sys_create(struct hid_device *hdev,
+				     struct hid_input *hi)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	struct input_dev *input;
+	unsigned int i, code;
+	bool any = false;
+	int ret;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
+
+	/* move the keys over from the gamepad */
+	for (i = 0; i < ARRAY_SIZE(microsoft_xbox_sys_keys); i++) {
+		code = microsoft_xbox_sys_keys[i];
+		if (!test_bit(code, hi->input->keybit))
+			continue;
+		__clear_bit(code, hi->input->keybit);
+		input_set_capability(input, EV_KEY, code);
+		any = true;
+	}
+	if (!any) {
+		input_free_device(input);
+		return 0;
+	}
+
+	snprintf(xsc->sys_name, sizeof(xsc->sys_name), "%s System Buttons",
+		 hdev->name);
+	input->name = xsc->sys_name;
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id = hi->input->id;
+	input->dev.parent = &hdev->dev;
+	input->open = microsoft_xbox_input_open;
+	input->close = microsoft_xbox_input_close;
+	input_set_drvdata(input, hdev);
+
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		return ret;
+	}
+
+	xsc->sys_input = input;
+	return 0;
+}
+
+/*
+ * Reports come in under driver_input_lock, which remove holds, or under
+ * xsc->lock from microsoft_xbox_replay(). Clearing the pointer under the
+ * latter leaves no way to the input device before it is unregistered.
+ */
+static void microsoft_xbox_sys_destroy(struct hid_device *hdev)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	struct input_dev *input;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xsc->lock, flags);
+	input = xsc->sys_input;
+	xsc->sys_input = NULL;
+	spin_unlock_irqrestore(&xsc->lock, flags);
+
+	if (input)
+		input_unregister_device(input);
+}
+
+static unsigned int microsoft_xbox_count_events(struct hid_report *report,
+						struct hid_input *hi)
+{
+	struct hid_usage *usage;
+	unsigned int i, j, n = 0;
+
+	for (i = 0; i < report->maxfield; i++) {
+		if (report->field[i]->hidinput != hi)
+			continue;
+
+		for (j = 0; j < report->field[i]->maxusage; j++) {
+			usage = &report->field[i]->usage[j];
+			if (usage->type != EV_ABS && usage->type != EV_KEY)
+				continue;
+			n++;
+			/* the hat switch reports both of its axes */
+			if (usage->hat_min < usage->hat_max)
+				n++;
+		}
+	}
+
+	return n;
+}
+
+static int microsoft_xbox_input_configured(struct hid_device *hdev,
+					   struct hid_input *hi)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+	struct hid_report *report;
+	unsigned int events;
+	int ret;
+
+	hi->input->open = microsoft_xbox_input_open;
+	hi->input->close = microsoft_xbox_input_close;
+
+	if (READ_ONCE(system_buttons) && !xsc->sys_input) {
+		ret = microsoft_xbox_sys_create(hdev, hi);
+		if (ret)
+			return ret;
+	}
+
+	/* size the evdev buffers for a full input report */
+	report = hdev->report_enum[HID_INPUT_REPORT].report_id_hash[XBOX_INPUT_REPORT];
+	if (report) {
+		events = microsoft_xbox_count_events(report, hi);
+		if (events) {
+			input_set_events_per_packet(hi->input, events);
+			xbox_burst_init(&xsc->burst, events);
+			xsc->events_per_report = events;
+		}
+	}
+
+	return 0;
+}
+
+static int microsoft_xbox_probe_timing_show(struct seq_file *s, void *unused)
+{
+	struct microsoft_xbox_sc *xsc = s->private;
+
+	seq_printf(s, "parse_ns:\t%llu\n", xsc->parse_ns);
+	seq_printf(s, "hw_start_ns:\t%llu\n", xsc->hw_start_ns);
+	seq_printf(s, "probe_ns:\t%llu\n", xsc->probe_ns);
+	seq_printf(s, "first_event_ns:\t%llu\n", xsc->first_event_ns);
+	seq_printf(s, "resumes:\t%u\n", xsc->resumes);
+	seq_printf(s, "resume_first_event_ns:\t%llu\n",
+		   xsc->resume_first_event_ns);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(microsoft_xbox_probe_timing);
+
+static int microsoft_xbox_burst_stats_show(struct seq_file *s, void *unused)
+{
+	struct microsoft_xbox_sc *xsc = s->private;
+	struct xbox_burst_stats b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xsc->lock, flags);
+	b = xsc->burst;
+	spin_unlock_irqrestore(&xsc->lock, flags);
+
+	seq_printf(s, "reports:\t%llu\n", b.reports);
+	seq_printf(s, "buffer_size:\t%u\n", b.buffer_size);
+	seq_printf(s, "max_burst:\t%u\n", b.max_events);
+	seq_printf(s, "bursts_over_buffer:\t%llu\n", b.over_buffer);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(microsoft_xbox_burst_stats);
+
+static void microsoft_xbox_debugfs_init(struct hid_device *hdev)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+
+	if (!hdev->debug_dir)
+		return;
+
+	xsc->debugfs = debugfs_create_dir("microsoft_xbox", hdev->debug_dir);
+	debugfs_create_file("probe_timing", 0444, xsc->debugfs, xsc,
+			    &microsoft_xbox_probe_timing_fops);
+	debugfs_create_file("burst_stats", 0444, xsc->debugfs, xsc,
+			    &microsoft_xbox_burst_stats_fops);
+}
+
+static unsigned int microsoft_xbox_connect_mask(struct hid_device *hdev)
+{
+	unsigned int mask = HID_CONNECT_DEFAULT;
+	int i, ret;
+
+	/* connect[] can be rewritten through sysfs at any time */
+	kernel_param_lock(THIS_MODULE);
+	for (i = 0; i < connect_count; i++) {
+		ret = xbox_connect_parse(hdev, connect[i], &mask);
+		if (ret < 0)
+			hid_warn(hdev, "ignoring malformed connect entry '%s'\n",
+				 connect[i]);
+		else if (ret)
+			break;
+	}
+	kernel_param_unlock(THIS_MODULE);
+
+	return mask;
+}
+
+/*
+ * hidp and uhid never call the suspend and resume callbacks of a HID
+ * driver, follow system sleep itself to time the first report after it.
+ */
+static int microsoft_xbox_pm_notify(struct notifier_block *nb,
+				    unsigned long action, void *data)
+{
+	struct microsoft_xbox_sc *xsc = container_of(nb, struct microsoft_xbox_sc,
+						     pm_nb);
+
+	switch (action) {
+	case PM_POST_HIBERNATION:
+	case PM_POST_SUSPEND:
+		xsc->resumes++;
+		WRITE_ONCE(xsc->resume_start, ktime_get_ns());
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
 static int microsoft_xbox_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	unsigned long quirks = id->driver_data;
+	u64 start = ktime_get_ns(), phase;
 	struct microsoft_xbox_sc *xsc;
+	struct hid_report *report;
 	int ret;
 
 	xsc = devm_kzalloc(&hdev->dev, sizeof(*xsc), GFP_KERNEL);
@@ -66,31 +642,70 @@ static int microsoft_xbox_probe(struct hid_device *hdev, const struct hid_device
 	}
 
 	xsc->quirks = quirks;
+	xsc->probe_start = start;
+	spin_lock_init(&xsc->lock);
 	hid_set_drvdata(hdev, xsc);
 
+	phase = ktime_get_ns();
 	ret = hid_parse(hdev);
 	if (ret) {
 		hid_err(hdev, "parse failed\n");
 		return ret;
 	}
+	xsc->parse_ns = ktime_get_ns() - phase;
+
+	report = hdev->report_enum[HID_INPUT_REPORT].report_id_hash[XBOX_INPUT_REPORT];
+	if (report) {
+		xsc->idle_len = hid_report_len(report);
+		xsc->idle_report = devm_kzalloc(&hdev->dev, xsc->idle_len,
+						GFP_KERNEL);
+		if (!xsc->idle_report)
+			return -ENOMEM;
+	}
 
-	ret = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
+	phase = ktime_get_ns();
+	ret = hid_hw_start(hdev, microsoft_xbox_connect_mask(hdev));
 	if (ret) {
 		hid_err(hdev, "hw start failed\n");
+		microsoft_xbox_sys_destroy(hdev);
 		return ret;
 	}
+	xsc->hw_start_ns = ktime_get_ns() - phase;
 
 	hid_err(hdev, "started driver\n");
 
+	xsc->pm_nb.notifier_call = microsoft_xbox_pm_notify;
+	ret = register_pm_notifier(&xsc->pm_nb);
+	if (ret) {
+		hid_warn(hdev, "could not follow system sleep: %d\n", ret);
+		xsc->pm_nb.notifier_call = NULL;
+	}
+
+	microsoft_xbox_debugfs_init(hdev);
+	xsc->probe_ns = ktime_get_ns() - start;
+
 	return 0;
 }
 
+static void microsoft_xbox_remove(struct hid_device *hdev)
+{
+	struct microsoft_xbox_sc *xsc = hid_get_drvdata(hdev);
+
+	if (xsc->pm_nb.notifier_call)
+		unregister_pm_notifier(&xsc->pm_nb);
+	debugfs_remove_recursive(xsc->debugfs);
+	/* closes through microsoft_xbox_input_close() while still started */
+	microsoft_xbox_sys_destroy(hdev);
+	hid_hw_stop(hdev);
+}
+
 static const struct hid_device_id microsoft_xbox_devices[] = {
 	/* XBOX ONE S / X model name 1708 */
 	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_MICROSOFT, 0x02E0) },
 	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_MICROSOFT, 0x02FD) },
 	/* XBOX ONE Elite Series 2 */
-	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_MICROSOFT, 0x0B05) },
+	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_MICROSOFT, 0x0B05),
+		.driver_data = XBOX_ELITE_2 },
 	/* XBOX Series X|S model name 1914*/
 	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_MICROSOFT, 0x0B13),
 		.driver_data = XBOX_SERIES_XS },
@@ -101,8 +716,17 @@ MODULE_DEVICE_TABLE(hid, microsoft_xbox_devices);
 static struct hid_driver microsoft_xbox_driver = {
 	.name = "microsoft_xbox",
 	.id_table = microsoft_xbox_devices,
+	.report_fixup = microsoft_xbox_report_fixup,
 	.input_mapping = microsoft_xbox_input_mapping,
+	.input_configured = microsoft_xbox_input_configured,
+	.raw_event = microsoft_xbox_raw_event,
+	.event = microsoft_xbox_event,
+	.report = microsoft_xbox_report,
 	.probe = microsoft_xbox_probe,
+	.remove = microsoft_xbox_remove,
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 module_hid_driver(microsoft_xbox_driver);
 
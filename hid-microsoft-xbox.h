@@ -0,0 +1,500 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Xbox Bluetooth controller definitions shared by hid-microsoft and
+ *  hid-microsoft-xbox
+ */
+
+#ifndef HID_MICROSOFT_XBOX_H_FILE
+#define HID_MICROSOFT_XBOX_H_FILE
+
+#include <linux/hid.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+#include "hid-ids.h"
+
+#define XBOX_INPUT_REPORT	1
+#define XBOX_HOME_REPORT	2
+#define XBOX_FF_REPORT		3
+#define XBOX_BATTERY_REPORT	4
+
+/*
+ * Canonical report descriptors. They describe the report layout of the
+ * firmware 5.x controllers, but only declare the usages the drivers use:
+ *
+ *   report 1: X, Y, Z, Rz (16 bit), brake, accelerator (10 bit), hat
+ *             switch (4 bit), 15 buttons and then the Share button on
+ *             the Series X|S or the four paddles and the active profile
+ *             on the Elite Series 2
+ *   report 2: AC Home, where the Guide button goes while the controller
+ *             is in Windows mode
+ *   report 3: rumble output report, see struct xb1s_ff_report
+ *   report 4: battery strength
+ */
+#define XBOX_RDESC_GAMEPAD						\
+	0x05, 0x01,		/* Usage Page (Generic Desktop)		*/ \
+	0x09, 0x05,		/* Usage (Game Pad)			*/ \
+	0xa1, 0x01,		/* Collection (Application)		*/ \
+	0x85, 0x01,		/*   Report ID (1)			*/ \
+	0x09, 0x01,		/*   Usage (Pointer)			*/ \
+	0xa1, 0x00,		/*   Collection (Physical)		*/ \
+	0x09, 0x30,		/*     Usage (X)			*/ \
+	0x09, 0x31,		/*     Usage (Y)			*/ \
+	0x15, 0x00,		/*     Logical Minimum (0)		*/ \
+	0x27, 0xff, 0xff, 0x00, 0x00, /* Logical Maximum (65535)	*/ \
+	0x95, 0x02,		/*     Report Count (2)			*/ \
+	0x75, 0x10,		/*     Report Size (16)			*/ \
+	0x81, 0x02,		/*     Input (Data,Var,Abs)		*/ \
+	0xc0,			/*   End Collection			*/ \
+	0x09, 0x01,		/*   Usage (Pointer)			*/ \
+	0xa1, 0x00,		/*   Collection (Physical)		*/ \
+	0x09, 0x32,		/*     Usage (Z)			*/ \
+	0x09, 0x35,		/*     Usage (Rz)			*/ \
+	0x81, 0x02,		/*     Input (Data,Var,Abs)		*/ \
+	0xc0,			/*   End Collection			*/ \
+	0x05, 0x02,		/*   Usage Page (Simulation Controls)	*/ \
+	0x09, 0xc5,		/*   Usage (Brake)			*/ \
+	0x26, 0xff, 0x03,	/*   Logical Maximum (1023)		*/ \
+	0x95, 0x01,		/*   Report Count (1)			*/ \
+	0x75, 0x0a,		/*   Report Size (10)			*/ \
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/ \
+	0x75, 0x06,		/*   Report Size (6)			*/ \
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/ \
+	0x09, 0xc4,		/*   Usage (Accelerator)		*/ \
+	0x75, 0x0a,		/*   Report Size (10)			*/ \
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/ \
+	0x75, 0x06,		/*   Report Size (6)			*/ \
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/ \
+	0x05, 0x01,		/*   Usage Page (Generic Desktop)	*/ \
+	0x09, 0x39,		/*   Usage (Hat switch)			*/ \
+	0x15, 0x01,		/*   Logical Minimum (1)		*/ \
+	0x25, 0x08,		/*   Logical Maximum (8)		*/ \
+	0x35, 0x00,		/*   Physical Minimum (0)		*/ \
+	0x46, 0x3b, 0x01,	/*   Physical Maximum (315)		*/ \
+	0x65, 0x14,		/*   Unit (Degrees)			*/ \
+	0x75, 0x04,		/*   Report Size (4)			*/ \
+	0x81, 0x42,		/*   Input (Data,Var,Abs,Null)		*/ \
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/ \
+	0x15, 0x00,		/*   Logical Minimum (0)		*/ \
+	0x25, 0x01,		/*   Logical Maximum (1)		*/ \
+	0x45, 0x00,		/*   Physical Maximum (0)		*/ \
+	0x65, 0x00,		/*   Unit (None)			*/ \
+	0x05, 0x09,		/*   Usage Page (Button)		*/ \
+	0x19, 0x01,		/*   Usage Minimum (1)			*/ \
+	0x29, 0x0f,		/*   Usage Maximum (15)			*/ \
+	0x75, 0x01,		/*   Report Size (1)			*/ \
+	0x95, 0x0f,		/*   Report Count (15)			*/ \
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/ \
+	0x95, 0x01,		/*   Report Count (1)			*/ \
+	0x81, 0x03		/*   Input (Cnst,Var,Abs)		*/
+
+#define XBOX_RDESC_HOME							\
+	0x05, 0x0c,		/*   Usage Page (Consumer)		*/ \
+	0x0a, 0x23, 0x02,	/*   Usage (AC Home)			*/ \
+	0x85, 0x02,		/*   Report ID (2)			*/ \
+	0x75, 0x01,		/*   Report Size (1)			*/ \
+	0x95, 0x01,		/*   Report Count (1)			*/ \
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/ \
+	0x75, 0x07,		/*   Report Size (7)			*/ \
+	0x81, 0x03		/*   Input (Cnst,Var,Abs)		*/
+
+#define XBOX_RDESC_FF_BATTERY						\
+	0x05, 0x0f,		/*   Usage Page (Physical Interface)	*/ \
+	0x09, 0x21,		/*   Usage (Set Effect Report)		*/ \
+	0x85, 0x03,		/*   Report ID (3)			*/ \
+	0xa1, 0x02,		/*   Collection (Logical)		*/ \
+	0x09, 0x97,		/*     Usage (DC Enable Actuators)	*/ \
+	0x75, 0x04,		/*     Report Size (4)			*/ \
+	0x91, 0x02,		/*     Output (Data,Var,Abs)		*/ \
+	0x91, 0x03,		/*     Output (Cnst,Var,Abs)		*/ \
+	0x09, 0x70,		/*     Usage (Magnitude)		*/ \
+	0x25, 0x64,		/*     Logical Maximum (100)		*/ \
+	0x75, 0x08,		/*     Report Size (8)			*/ \
+	0x95, 0x04,		/*     Report Count (4)			*/ \
+	0x91, 0x02,		/*     Output (Data,Var,Abs)		*/ \
+	0x09, 0x50,		/*     Usage (Duration)			*/ \
+	0x66, 0x01, 0x10,	/*     Unit (Seconds)			*/ \
+	0x55, 0x0e,		/*     Unit Exponent (-2)		*/ \
+	0x26, 0xff, 0x00,	/*     Logical Maximum (255)		*/ \
+	0x95, 0x01,		/*     Report Count (1)			*/ \
+	0x91, 0x02,		/*     Output (Data,Var,Abs)		*/ \
+	0x09, 0xa7,		/*     Usage (Start Delay)		*/ \
+	0x91, 0x02,		/*     Output (Data,Var,Abs)		*/ \
+	0x65, 0x00,		/*     Unit (None)			*/ \
+	0x55, 0x00,		/*     Unit Exponent (0)		*/ \
+	0x09, 0x7c,		/*     Usage (Loop Count)		*/ \
+	0x91, 0x02,		/*     Output (Data,Var,Abs)		*/ \
+	0xc0,			/*   End Collection			*/ \
+	0x05, 0x06,		/*   Usage Page (Generic Device Controls) */ \
+	0x09, 0x20,		/*   Usage (Battery Strength)		*/ \
+	0x85, 0x04,		/*   Report ID (4)			*/ \
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/ \
+	0xc0			/* End Collection			*/
+
+/*
+ * hid-core copies the descriptor report_fixup() returns, these are never
+ * written to.
+ */
+static const __u8 xbox_one_s_rdesc[] = {
+	XBOX_RDESC_GAMEPAD,
+	XBOX_RDESC_HOME,
+	XBOX_RDESC_FF_BATTERY,
+};
+
+static const __u8 xbox_series_xs_rdesc[] = {
+	XBOX_RDESC_GAMEPAD,
+	0x05, 0x0c,		/*   Usage Page (Consumer)		*/
+	0x09, 0xb2,		/*   Usage (Record), the Share button	*/
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/
+	0x75, 0x07,		/*   Report Size (7)			*/
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/
+	XBOX_RDESC_HOME,
+	XBOX_RDESC_FF_BATTERY,
+};
+
+static const __u8 xbox_elite_2_rdesc[] = {
+	XBOX_RDESC_GAMEPAD,
+	0x19, 0x11,		/*   Usage Minimum (17), paddle P1	*/
+	0x29, 0x14,		/*   Usage Maximum (20)			*/
+	0x95, 0x04,		/*   Report Count (4)			*/
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/
+	0x06, 0x00, 0xff,	/*   Usage Page (Vendor Defined 0xff00)	*/
+	0x09, 0x01,		/*   Usage (Vendor Usage 1), profile	*/
+	0x25, 0x03,		/*   Logical Maximum (3)		*/
+	0x75, 0x02,		/*   Report Size (2)			*/
+	0x95, 0x01,		/*   Report Count (1)			*/
+	0x81, 0x02,		/*   Input (Data,Var,Abs)		*/
+	0x75, 0x06,		/*   Report Size (6)			*/
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs)		*/
+	0x25, 0x01,		/*   Logical Maximum (1)		*/
+	XBOX_RDESC_HOME,
+	XBOX_RDESC_FF_BATTERY,
+};
+
+/* input report 1 as laid out by the canonical descriptors */
+struct xbox_input_report {
+	__u8 report_id;
+	__le16 x;
+	__le16 y;
+	__le16 z;
+	__le16 rz;
+	__le16 brake;		/* 10 bit */
+	__le16 accelerator;	/* 10 bit */
+	__u8 hat;		/* 4 bit, 0 is null */
+	__le16 buttons;		/* 15 bit */
+} __packed;
+
+#define XBOX_TRIGGER_MAX	1023
+#define XBOX_HAT_MAX		8
+#define XBOX_BUTTONS		15
+
+/* controls following the buttons, byte offsets in input report 1 */
+#define XBOX_SHARE_OFFSET	16	/* Series X|S, bit 0 */
+#define XBOX_PADDLES_OFFSET	16	/* Elite Series 2, bits 0-3 */
+#define XBOX_PADDLES		4
+#define XBOX_PADDLE_USAGE	17	/* button usage of P1 */
+#define XBOX_PROFILE_OFFSET	17	/* Elite Series 2, bits 0-1 */
+#define XBOX_PROFILE_MAX	3
+#define XBOX_INPUT_REPORT_MAX	18
+
+#define XBOX_FEATURE_SHARE	BIT(0)
+#define XBOX_FEATURE_PADDLES	BIT(1)
+
+/*
+ * Bit offset and size of a data main item, and its first usage: the
+ * first Usage or Usage Minimum, with the usage page in the upper half.
+ */
+struct xbox_rdesc_field {
+	u16 offset;
+	u8 size;
+	u8 count;
+	u32 usage;
+};
+
+#define XBOX_LAYOUT_GAMEPAD						\
+	{ 0, 16, 2, HID_GD_X }, { 32, 16, 2, HID_GD_Z },		\
+	{ 64, 10, 1, HID_UP_SIMULATION | 0xc5 },			\
+	{ 80, 10, 1, HID_UP_SIMULATION | 0xc4 },			\
+	{ 96, 4, 1, HID_GD_HATSWITCH }, { 104, 1, 15, HID_UP_BUTTON | 1 }
+
+static const struct xbox_rdesc_field xbox_one_s_layout[] = {
+	XBOX_LAYOUT_GAMEPAD,
+};
+
+static const struct xbox_rdesc_field xbox_series_xs_layout[] = {
+	XBOX_LAYOUT_GAMEPAD,
+	{ 120, 1, 1, HID_UP_CONSUMER | 0xb2 },
+};
+
+static const struct xbox_rdesc_field xbox_elite_2_layout[] = {
+	XBOX_LAYOUT_GAMEPAD,
+	{ 120, 1, XBOX_PADDLES, HID_UP_BUTTON | XBOX_PADDLE_USAGE },
+	{ 128, 2, 1, HID_UP_MSVENDOR | 0x01 },
+};
+
+struct xbox_rdesc {
+	u16 product;
+	const struct xbox_rdesc_field *layout;
+	unsigned int nfields;
+	unsigned int input_bits;
+	const __u8 *rdesc;
+	unsigned int size;
+	unsigned int features;
+};
+
+static const struct xbox_rdesc xbox_rdescs[] = {
+	{ USB_DEVICE_ID_MS_XBOX_ONE_S_CONTROLLER,
+		xbox_one_s_layout, ARRAY_SIZE(xbox_one_s_layout), 120,
+		xbox_one_s_rdesc, sizeof(xbox_one_s_rdesc), 0 },
+	{ USB_DEVICE_ID_MS_XBOX_SERIES_X_CONTROLLER,
+		xbox_series_xs_layout, ARRAY_SIZE(xbox_series_xs_layout), 128,
+		xbox_series_xs_rdesc, sizeof(xbox_series_xs_rdesc),
+		XBOX_FEATURE_SHARE },
+	{ USB_DEVICE_ID_MS_XBOX_ELITE_2_CONTROLLER,
+		xbox_elite_2_layout, ARRAY_SIZE(xbox_elite_2_layout), 136,
+		xbox_elite_2_rdesc, sizeof(xbox_elite_2_rdesc),
+		XBOX_FEATURE_PADDLES },
+};
+
+/*
+ * Walk the short items of a report descriptor and check the main items
+ * of one report: the data items must sit at the bit offsets listed in
+ * @layout (when given), with its sizes and first usages, and the report
+ * must be @bits long. The drivers read Share, the paddles and the
+ * profile at fixed offsets, so a descriptor carrying other controls
+ * there must not match. Descriptors using Push/Pop are not recognised.
+ */
+static inline bool xbox_rdesc_check(const __u8 *rdesc, unsigned int rsize,
+		u8 main_tag, u8 id, const struct xbox_rdesc_field *layout,
+		unsigned int nfields, unsigned int bits)
+{
+	unsigned int report_size = 0, report_count = 0, report_id = 0;
+	unsigned int offset = 0, field = 0, i = 0;
+	u32 usage_page = 0, usage = 0;
+	unsigned int usage_len = 0;	/* of the first usage, 0 for none */
+
+	while (i < rsize) {
+		u8 item = rdesc[i];
+		unsigned int len = item & 0x03, value = 0, j;
+
+		/* long item */
+		if (item == 0xfe) {
+			if (i + 1 >= rsize)
+				return false;
+			i += 3 + rdesc[i + 1];
+			continue;
+		}
+
+		if (len == 3)
+			len = 4;
+		if (i + 1 + len > rsize)
+			return false;
+		for (j = 0; j < len; j++)
+			value |= (unsigned int)rdesc[i + 1 + j] << (8 * j);
+
+		switch (item & 0xfc) {
+		case 0x74:	/* Report Size */
+			report_size = value;
+			break;
+		case 0x94:	/* Report Count */
+			report_count = value;
+			break;
+		case 0x84:	/* Report ID */
+			report_id = value;
+			break;
+		case 0x04:	/* Usage Page */
+			usage_page = value;
+			break;
+		case 0x08:	/* Usage */
+		case 0x18:	/* Usage Minimum */
+			if (!usage_len) {
+				usage = value;
+				usage_len = len;
+			}
+			break;
+		case 0xa4:	/* Push */
+		case 0xb4:	/* Pop */
+			return false;
+		case 0xa0:	/* Collection */
+		case 0xc0:	/* End Collection */
+			usage_len = 0;
+			break;
+		default:
+			if ((item & 0xfc) != 0x80 && (item & 0xfc) != 0x90 &&
+			    (item & 0xfc) != 0xb0)
+				break;
+
+			/* the usage page applies at the main item, as in hid-core */
+			if (usage_len && usage_len < 4)
+				usage |= usage_page << 16;
+			if ((item & 0xfc) == main_tag && report_id == id) {
+				if (layout && !(value & 0x01)) {
+					if (field >= nfields ||
+					    layout[field].offset != offset ||
+					    layout[field].size != report_size ||
+					    layout[field].count != report_count ||
+					    !usage_len ||
+					    layout[field].usage != usage)
+						return false;
+					field++;
+				}
+				offset += report_size * report_count;
+			}
+			usage_len = 0;
+			break;
+		}
+
+		i += 1 + len;
+	}
+
+	return field == (layout ? nfields : 0) && offset == bits;
+}
+
+/*
+ * A HID-BPF program rewrote the descriptor of @hdev. hid-core hands the
+ * driver a copy either way, so compare the contents.
+ */
+static inline bool xbox_rdesc_bpf_fixed(struct hid_device *hdev)
+{
+	if (!IS_ENABLED(CONFIG_HID_BPF) || !hdev->bpf_rdesc)
+		return false;
+
+	return hdev->bpf_rsize != hdev->dev_rsize ||
+	       memcmp(hdev->bpf_rdesc, hdev->dev_rdesc, hdev->dev_rsize);
+}
+
+/*
+ * Find the canonical descriptor for @hdev if its own descriptor has the
+ * known input, rumble and battery report layout. A descriptor fixed up
+ * by HID-BPF is kept as it is, whatever it looks like.
+ */
+static inline const struct xbox_rdesc *xbox_rdesc_match(
+		struct hid_device *hdev, const __u8 *rdesc, unsigned int rsize)
+{
+	const struct xbox_rdesc *x;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xbox_rdescs); i++) {
+		x = &xbox_rdescs[i];
+
+		if (hdev->product != x->product)
+			continue;
+
+		/* already canonical, or too short to hold the known reports */
+		if (rsize <= x->size)
+			continue;
+
+		if (xbox_rdesc_check(rdesc, rsize, 0x80, XBOX_INPUT_REPORT,
+				     x->layout, x->nfields, x->input_bits) &&
+		    xbox_rdesc_check(rdesc, rsize, 0x90, XBOX_FF_REPORT,
+				     NULL, 0, 64) &&
+		    xbox_rdesc_check(rdesc, rsize, 0x80, XBOX_BATTERY_REPORT,
+				     NULL, 0, 8)) {
+			if (xbox_rdesc_bpf_fixed(hdev)) {
+				hid_info(hdev, "keeping the HID-BPF report descriptor\n");
+				return NULL;
+			}
+			return x;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reports closer together than this are taken to be a burst, queued up
+ * behind a stalled link, which a reader can't drain in between. Drivers
+ * don't see the SYN_DROPPED of an evdev client, a burst larger than the
+ * client buffer is only a burst that may have made one.
+ */
+#define XBOX_BURST_GAP_NS	NSEC_PER_MSEC
+
+/* evdev_compute_buffer_size() */
+#define XBOX_EVDEV_BUF_PACKETS		8
+#define XBOX_EVDEV_MIN_BUFFER_SIZE	64U
+
+/* updated under the lock of the driver's report path */
+struct xbox_burst_stats {
+	u64 reports;
+	u64 last_ns;
+	unsigned int events;		/* in the current burst */
+	unsigned int max_events;
+	unsigned int buffer_size;	/* of each evdev client */
+	u64 over_buffer;		/* bursts larger than buffer_size */
+};
+
+static inline void xbox_burst_init(struct xbox_burst_stats *b,
+				   unsigned int events_per_packet)
+{
+	b->buffer_size = roundup_pow_of_two(max(events_per_packet *
+						XBOX_EVDEV_BUF_PACKETS,
+						XBOX_EVDEV_MIN_BUFFER_SIZE));
+}
+
+/* account for @events queued to evdev, SYN_REPORT included */
+static inline void xbox_burst_account(struct xbox_burst_stats *b,
+				      unsigned int events)
+{
+	u64 now = ktime_get_ns();
+	unsigned int before = b->events;
+
+	if (now - b->last_ns > XBOX_BURST_GAP_NS)
+		before = 0;
+	b->events = before + events;
+	b->last_ns = now;
+	b->reports++;
+
+	if (b->events > b->max_events)
+		b->max_events = b->events;
+	/* once per burst */
+	if (b->events > b->buffer_size && before <= b->buffer_size)
+		b->over_buffer++;
+}
+
+/*
+ * Parse a "<vendor>:<product>:<iface>[+<iface>...]" connect policy, with
+ * iface one of input, hidraw, hiddev, ff or none. Returns 1 and sets
+ * @mask if the entry applies to @hdev, 0 if it doesn't and -EINVAL if it
+ * is malformed.
+ */
+static inline int xbox_connect_parse(struct hid_device *hdev,
+				     const char *spec, unsigned int *mask)
+{
+	static const struct {
+		const char *name;
+		unsigned int mask;
+	} ifaces[] = {
+		{ "none", 0 },
+		{ "input", HID_CONNECT_HIDINPUT },
+		{ "hidraw", HID_CONNECT_HIDRAW },
+		{ "hiddev", HID_CONNECT_HIDDEV },
+		{ "ff", HID_CONNECT_FF },
+	};
+	unsigned int vendor, product, m = 0, i;
+	size_t len;
+	int n = 0;
+
+	if (sscanf(spec, "%x:%x:%n", &vendor, &product, &n) != 2 || !n)
+		return -EINVAL;
+
+	for (spec += n; *spec; spec += len + !!spec[len]) {
+		len = strcspn(spec, "+");
+		for (i = 0; i < ARRAY_SIZE(ifaces); i++)
+			if (strlen(ifaces[i].name) == len &&
+			    !strncmp(spec, ifaces[i].name, len))
+				break;
+		if (i == ARRAY_SIZE(ifaces))
+			return -EINVAL;
+		m |= ifaces[i].mask;
+	}
+
+	if (vendor != hdev->vendor || product != hdev->product)
+		return 0;
+
+	*mask = m;
+	return 1;
+}
+
+#endif
@@ -12,12 +12,35 @@
 /*
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/configfs.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/firmware.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
 #include <linux/input.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/kref.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/power_supply.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/suspend.h>
 
 #include "hid-ids.h"
+#include "hid-microsoft-dial.h"
+#include "hid-microsoft-uapi.h"
+#include "hid-microsoft-xbox.h"
 
 #define MS_HIDINPUT		BIT(0)
 #define MS_ERGONOMY		BIT(1)
@@ -28,22 +51,366 @@
 #define MS_SURFACE_DIAL		BIT(6)
 #define MS_QUIRK_FF		BIT(7)
 #define MS_XBOX_SERIES_X        BIT(8)
+#define MS_MOUSE		BIT(9)
+
+static bool mouse_fast_path = true;
+module_param(mouse_fast_path, bool, 0644);
+MODULE_PARM_DESC(mouse_fast_path, "Report mouse motion, wheel and buttons from the driver instead of hid-input, skipping hid-core's field walk for reports carrying nothing else, needed for mouse_interval_us (applies on probe)");
+
+static unsigned int reconnect_grace_ms;
+module_param(reconnect_grace_ms, uint, 0644);
+MODULE_PARM_DESC(reconnect_grace_ms, "Keep the input device of a disconnected Xbox controller for this many milliseconds (0 = disabled, otherwise implies gamepad_input)");
+
+static bool gamepad_input;
+module_param(gamepad_input, bool, 0644);
+MODULE_PARM_DESC(gamepad_input, "Report Xbox controllers with a known report layout from an input device of the driver instead of hid-input, needed for state_page, system_buttons, remapping, mouse emulation and frame pacing (applies on probe)");
+
+static bool state_page;
+module_param(state_page, bool, 0644);
+MODULE_PARM_DESC(state_page, "Expose the state of Xbox controllers in an mmap-able page, with gamepad_input (applies to new controllers)");
+
+static unsigned int ff_align_us;
+module_param(ff_align_us, uint, 0644);
+MODULE_PARM_DESC(ff_align_us, "Hold rumble output reports for up to this many microseconds to send them right after an input report, rumble group triggers are always sent at once (0 = send at once)");
+
+static bool system_buttons;
+module_param(system_buttons, bool, 0644);
+MODULE_PARM_DESC(system_buttons, "Report Guide and Share of Xbox controllers on an input device of their own, with gamepad_input (applies to new controllers)");
+
+static bool haptics_stream;
+module_param(haptics_stream, bool, 0644);
+MODULE_PARM_DESC(haptics_stream, "Expose an mmap-able ring of rumble frames for devices with rumble (applies on probe)");
+
+static unsigned int mouse_interval_us;
+module_param(mouse_interval_us, uint, 0644);
+MODULE_PARM_DESC(mouse_interval_us, "Aggregate mouse motion over this many microseconds (0 = report every input report)");
+
+/*
+ * Location of a variable usage inside its raw report, recorded at mapping
+ * time so the usage can be decoded straight from .raw_event without going
+ * through hid-core's per-usage dispatch.
+ */
+struct ms_raw_usage {
+	struct input_dev *input;
+	struct hid_report *report;
+	unsigned int offset;
+	unsigned int size;
+	bool is_signed;
+};
+
+#define MS_MOUSE_BUTTONS	8
+
+struct ms_mouse {
+	bool fast_path;
+	bool bypass;			/* hid-core doesn't see the report */
+	struct input_dev *input;
+	struct hid_report *report;
+	struct ms_raw_usage x;
+	struct ms_raw_usage y;
+	struct ms_raw_usage wheel;
+	struct ms_raw_usage button[MS_MOUSE_BUTTONS];
+
+	spinlock_t lock;		/* protects everything below */
+	struct hrtimer timer;
+	ktime_t last_flush;
+	int dx;
+	int dy;
+	int dwheel;
+	__u8 buttons;
+	__u8 buttons_sent;
+	bool in_report;			/* hid-core is reporting to input */
+	bool flush;			/* left to ms_report() */
+	bool stopped;			/* the timer stays off */
+
+	/* per report cost, measured from .raw_event to .report */
+	u64 report_start;
+	u64 reports;
+	u64 report_ns;
+};
+
+/* the dial has haptic detents every 10 degrees */
+#define MS_DIAL_DETENT_DEGREES	10
+
+struct ms_dial {
+	struct ms_raw_usage dial;
+	int units_per_detent;
+	struct ms_dial_remainder rem;
+};
+
+#define MS_GAMEPAD_AXES		6
+
+/* the 15 report buttons, Share and the four paddles */
+#define MS_GAMEPAD_GUIDE	12
+#define MS_GAMEPAD_SHARE	XBOX_BUTTONS
+#define MS_GAMEPAD_PADDLE1	(MS_GAMEPAD_SHARE + 1)
+#define MS_GAMEPAD_BUTTONS	(MS_GAMEPAD_PADDLE1 + XBOX_PADDLES)
+
+/*
+ * Axes, both hat axes, the profile and every button twice in frame paced
+ * mode.
+ */
+#define MS_GAMEPAD_EVENTS	(MS_GAMEPAD_AXES + 3 + 2 * MS_GAMEPAD_BUTTONS)
+
+struct ms_gamepad_state {
+	u16 axes[MS_GAMEPAD_AXES];
+	u8 hat;
+	u8 profile;
+	u32 buttons;
+};
+
+#define MS_REMAP_NONE		U8_MAX
+
+/*
+ * Compiled remap profile: where each button bit and axis of the decoded
+ * report ends up, MS_REMAP_NONE for masked inputs.
+ */
+struct ms_remap {
+	struct rcu_head rcu;
+	u8 button[MS_GAMEPAD_BUTTONS];
+	struct {
+		u8 target;
+		bool invert;
+	} axis[MS_GAMEPAD_AXES];
+	bool hat_masked;
+};
+
+#define MS_MOUSE_EMU_DEADZONE	4096
+#define MS_MOUSE_EMU_SPEED	1600	/* pixels per second at full tilt */
+#define MS_MOUSE_EMU_RATE_MAX	1000
+
+#define MS_FRAME_RATE_MAX	1000
+#define MS_FRAME_LOG		8	/* button changes kept per period */
+
+/*
+ * Mouse driven by the right stick and the triggers, polled at a fixed
+ * rate so the cursor moves while the stick is held still.
+ */
+struct ms_mouse_emu {
+	struct input_dev *input;
+	struct hrtimer timer;
+	ktime_t period;
+	unsigned int rate;
+	char name[136];
+	int rem_x;
+	int rem_y;
+	unsigned long buttons;
+	bool opened;			/* under gp->mutex */
+	struct ms_gamepad *gp;
+};
+
+/* see struct ms_gamepad_state_page */
+struct ms_state_page {
+	struct kref kref;		/* the gamepad and every open file */
+	struct miscdevice misc;
+	char name[16];
+	int minor_id;
+	struct page *page;
+	struct ms_gamepad_state_page *data;
+	spinlock_t lock;		/* serializes writers */
+	u64 report_seq;
+
+	/* open files and mappings, they keep the gamepad active */
+	struct mutex users_lock;	/* protects users and gp */
+	unsigned int users;
+	struct ms_gamepad *gp;		/* NULL once the gamepad is gone */
+};
+
+/* see struct ms_haptics_ring */
+struct ms_haptics {
+	struct kref kref;		/* the HID device and every open file */
+	struct miscdevice misc;
+	char name[16];
+	int minor_id;
+	struct page *page;
+	struct ms_haptics_ring *ring;
+	struct hrtimer timer;
+	u32 tail;
+	struct mutex mutex;		/* protects users */
+	unsigned int users;
+	spinlock_t lock;		/* protects ms and armed */
+	bool armed;			/* only the timer re-arms itself */
+	struct ms_data *ms;		/* NULL once the device is gone */
+};
+
+/*
+ * Xbox controllers using a canonical descriptor are decoded by the driver
+ * and have an input device of their own instead of one from hid-input.
+ * It is not tied to the HID device, so it can be parked when the
+ * controller disconnects and picked up again when it comes back.
+ */
+struct ms_gamepad {
+	struct list_head list;		/* on ms_gamepads_parked */
+	struct delayed_work expire;
+	struct input_dev *input;
+	const unsigned int *axes;
+	unsigned int features;		/* XBOX_FEATURE_* */
+	u32 buttons;			/* buttons the model has */
+	struct ms_gamepad_state state;
+	struct ms_gamepad_state decoded;	/* last input report */
+	bool home;			/* Guide from the consumer report */
+	struct ms_remap __rcu *remap;	/* NULL for the identity */
+	struct ms_state_page *state_page;
+	struct ms_mouse_emu *mouse_emu;
+
+	/* Guide and Share on an input device of their own, see system_buttons */
+	struct input_dev *sys_input;
+	u32 sys_buttons;
+	bool sys_dirty;
+	char sys_name[144];
+
+	char name[128];
+	char phys[64];
+	char uniq[64];
+	__u16 product;
+
+	struct mutex mutex;		/* protects opened, remap updates,
+					 * mouse_emu, ff_used, attach/detach */
+	unsigned int opened;		/* open input devices */
+	bool ff_used;			/* an effect was uploaded */
+	int (*ff_upload)(struct input_dev *dev, struct ff_effect *effect,
+			 struct ff_effect *old);
+
+	/*
+	 * Serialises everything that reports to the input devices and the
+	 * state it works on: state, decoded, home, active, the idle report
+	 * and the frame. Taken before the event_lock of the input devices,
+	 * so never from play_effect.
+	 */
+	spinlock_t lock;
+
+	spinlock_t ff_lock;		/* protects ms, strong and weak */
+	struct ms_data *ms;		/* NULL while parked */
+	__u8 strong;
+	__u8 weak;
+
+	/*
+	 * Without any consumer, input reports are only stored and are
+	 * decoded once somebody starts listening.
+	 */
+	bool active;
+	unsigned int idle_size;
+	u8 idle_report[XBOX_INPUT_REPORT_MAX];
+
+	/*
+	 * Frame paced mode: reports are merged and emitted once per period.
+	 * log has the states replaced during the period by one with other
+	 * buttons, oldest first, each of them gets a frame of its own.
+	 */
+	struct {
+		struct hrtimer timer;
+		ktime_t period;
+		unsigned int rate;
+		struct ms_gamepad_state pending;
+		struct ms_gamepad_state log[MS_FRAME_LOG];
+		unsigned int nlog;
+		bool dirty;
+		bool armed;		/* started, the timer disarms itself */
+	} frame;
+
+	unsigned int events;		/* emitted since the last sync */
+	struct xbox_burst_stats burst;
+};
+
+/*
+ * Probe phases, connect to first input report and the last resume to the
+ * first input report after it, in ns.
+ */
+struct ms_probe_timing {
+	u64 start;
+	u64 parse;
+	u64 hw_start;
+	u64 input;
+	u64 total;
+	u64 first_event;
+	u64 resume_start;	/* 0 once an event arrived */
+	u64 resume_first_event;
+	unsigned int resumes;
+};
+
+/*
+ * Input report cadence of a device with rumble, learned from the arrival
+ * times, and the statistics of output reports timed against it. Jitter is
+ * the deviation of a report interval from the learned period, split by
+ * whether an output report went out during the interval.
+ */
+struct ms_ff_align {
+	spinlock_t lock;
+	struct hrtimer timer;		/* sends anyway once the budget is spent */
+	u64 last_ns;			/* arrival of the last input report */
+	u64 period_ns;			/* EWMA of the report interval */
+	u64 requested_ns;		/* oldest request not sent yet, or 0 */
+	u64 sent_ns;			/* end of the last send */
+	u64 released_ns;		/* input report that released a send */
+	bool waiting;			/* for the next input report */
+
+	struct ms_ff_align_stats {
+		u64 intervals;
+		u64 jitter_ns;
+		u64 jitter_max_ns;
+		u64 ff_intervals;
+		u64 ff_jitter_ns;
+		u64 ff_jitter_max_ns;
+
+		u64 sends;
+		u64 aligned;
+		u64 fallbacks;
+		u64 latency_ns;
+		u64 latency_max_ns;
+		u64 report_to_sends;
+		u64 report_to_send_ns;
+		u64 report_to_send_max_ns;
+	} stats;
+};
 
 struct ms_data {
 	unsigned long quirks;
 	struct hid_device *hdev;
+	struct ms_raw_usage ergo_keypad;
+	struct ms_raw_usage ergo_wheel;
+	struct ms_raw_usage ergo_fn;
+	__u8 ergo_keypad_state;
+	__u8 ergo_fn_state;
+	struct ms_mouse mouse;
+	struct ms_dial dial;
+	struct dentry *debugfs;
+	const struct xbox_rdesc *xbox_rdesc;
+	const char *rdesc_applied[4];
+	unsigned int rdesc_napplied;
+	u64 rdesc_fixup_ns;
+	struct ms_probe_timing timing;
+	struct ms_gamepad *gamepad;
+	struct power_supply *battery;
+	struct power_supply_desc battery_desc;
+	int battery_capacity;
 	struct work_struct ff_worker;
+	struct ms_ff_align ff_align;
+	spinlock_t ff_lock;		/* protects strong to triggers, taken
+					 * after gp->ff_lock */
 	__u8 strong;
 	__u8 weak;
-	void *output_report_dmabuf;
+	__u8 left_trigger;
+	__u8 right_trigger;
+	bool triggers;			/* trigger motors were last sent on */
+	void *output_report_dmabuf;	/* see ms_ff_prepare() */
+	int (*ff_upload)(struct input_dev *dev, struct ff_effect *effect,
+			 struct ff_effect *old);
+	struct ms_haptics *haptics;
+	struct list_head ff_node;	/* on ms_ff_devices */
+	bool suspended;			/* no output reports while set */
+	bool haptics_owned;		/* the haptics ring has the motors */
+	struct notifier_block pm_nb;
 };
 
-#define XB1S_FF_REPORT		3
+#define XB1S_FF_REPORT		XBOX_FF_REPORT
 #define ENABLE_WEAK		BIT(0)
 #define ENABLE_STRONG		BIT(1)
+#define ENABLE_RIGHT_TRIGGER	BIT(2)
+#define ENABLE_LEFT_TRIGGER	BIT(3)
 
 enum {
-	MAGNITUDE_STRONG = 2,
+	MAGNITUDE_LEFT_TRIGGER,
+	MAGNITUDE_RIGHT_TRIGGER,
+	MAGNITUDE_STRONG,
 	MAGNITUDE_WEAK,
 	MAGNITUDE_NUM
 };
@@ -57,31 +424,362 @@ struct xb1s_ff_report {
 	__u8	loop_count;
 } __packed;
 
-static __u8 *ms_report_fixup(struct hid_device *hdev, __u8 *rdesc,
+/*
+ * Report descriptor fixups. Each entry is matched on size first, then
+ * product, quirks, the old bytes of its patches and finally the CRC32
+ * (as computed by zlib) of the descriptor, so most entries are rejected
+ * without touching the descriptor at all. An entry either patches single
+ * bytes or replaces the whole descriptor.
+ */
+struct ms_rdesc_patch {
+	unsigned int offset;
+	__u8 old;
+	__u8 new;
+};
+
+struct ms_rdesc_fixup {
+	const char *name;
+	__u16 product;		/* 0 matches any product */
+	unsigned long quirks;	/* 0 matches any quirks */
+	unsigned int size;	/* 0 matches any size */
+	u32 crc;		/* 0 skips the CRC check */
+	const struct ms_rdesc_patch *patches;
+	unsigned int npatches;
+	/* full replacement, NULL when the descriptor isn't recognised */
+	__u8 *(*replace)(struct hid_device *hdev, __u8 *rdesc,
+			 unsigned int *rsize);
+	const char *firmware;
+	/* loaded once by the first probe that could use it */
+	const struct firmware *fw;
+	bool fw_tried;
+	char *spec;
+};
+
+#define MS_RDESC_FIXUPS_MAX	8
+
+static char *rdesc_fixup[MS_RDESC_FIXUPS_MAX];
+static int rdesc_fixup_count;
+module_param_array(rdesc_fixup, charp, &rdesc_fixup_count, 0444);
+MODULE_PARM_DESC(rdesc_fixup, "Extra report descriptor fixups, <pid>:<size>:<crc32>:<off>=<old>><new>[,...] or <pid>:<size>:<crc32>:fw=<file>, hex, 0 matches any but at least one must be set");
+
+#define MS_CONNECT_MAX		8
+
+static char *connect[MS_CONNECT_MAX];
+static int connect_count;
+module_param_array(connect, charp, &connect_count, 0644);
+MODULE_PARM_DESC(connect, "Interfaces to connect per device, <vid>:<pid>:<iface>[+<iface>...] with iface input, hidraw, hiddev, ff or none (applies on probe)");
+
+static struct ms_rdesc_fixup ms_rdesc_user_fixups[MS_RDESC_FIXUPS_MAX];
+static unsigned int ms_rdesc_user_count;
+static DEFINE_MUTEX(ms_rdesc_fw_lock);
+
+static __u8 *ms_xbox_rdesc_replace(struct hid_device *hdev, __u8 *rdesc,
 		unsigned int *rsize)
 {
 	struct ms_data *ms = hid_get_drvdata(hdev);
-	unsigned long quirks = ms->quirks;
+	const struct xbox_rdesc *x = xbox_rdesc_match(hdev, rdesc, *rsize);
+
+	if (!x)
+		return NULL;
+
+	ms->xbox_rdesc = x;
+	*rsize = x->size;
+	return (__u8 *)x->rdesc;
+}
+
+/*
+ * Microsoft Wireless Desktop Receiver (Model 1028) has
+ * 'Usage Min/Max' where it ought to have 'Physical Min/Max'
+ */
+static const struct ms_rdesc_patch ms_1028_patches[] = {
+	{ 557, 0x19, 0x35 },
+	{ 559, 0x29, 0x45 },
+};
 
+static const struct ms_rdesc_fixup ms_rdesc_fixups[] = {
+	{
+		.name = "Microsoft Wireless Receiver Model 1028",
+		.quirks = MS_RDESC,
+		.size = 571,
+		.patches = ms_1028_patches,
+		.npatches = ARRAY_SIZE(ms_1028_patches),
+	},
 	/*
-	 * Microsoft Wireless Desktop Receiver (Model 1028) has
-	 * 'Usage Min/Max' where it ought to have 'Physical Min/Max'
+	 * Xbox controllers: the descriptor differs between firmwares, swap
+	 * it for the canonical one when the report layout is a known one.
 	 */
-	if ((quirks & MS_RDESC) && *rsize == 571 && rdesc[557] == 0x19 &&
-			rdesc[559] == 0x29) {
-		hid_info(hdev, "fixing up Microsoft Wireless Receiver Model 1028 report descriptor\n");
-		rdesc[557] = 0x35;
-		rdesc[559] = 0x45;
+	{
+		.name = "canonical Xbox descriptor",
+		.quirks = MS_QUIRK_FF,
+		.replace = ms_xbox_rdesc_replace,
+	},
+};
+
+static bool ms_rdesc_fixup_match(struct hid_device *hdev,
+		const struct ms_rdesc_fixup *f, const __u8 *rdesc,
+		unsigned int rsize, u32 *crc, bool *crc_valid)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	unsigned int i;
+
+	if (f->size && f->size != rsize)
+		return false;
+	if (f->product && f->product != hdev->product)
+		return false;
+	if (f->quirks && !(ms->quirks & f->quirks))
+		return false;
+
+	for (i = 0; i < f->npatches; i++) {
+		if (f->patches[i].offset >= rsize ||
+				rdesc[f->patches[i].offset] != f->patches[i].old)
+			return false;
+	}
+
+	if (f->crc) {
+		if (!*crc_valid) {
+			*crc = ~crc32_le(~0, rdesc, rsize);
+			*crc_valid = true;
+		}
+		if (*crc != f->crc)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * report_fixup() runs from hid_parse() and must not wait for userspace,
+ * so the replacement descriptors are loaded before that, without the
+ * usermode helper fallback, and kept until the module goes away.
+ */
+static void ms_rdesc_fixups_load(struct hid_device *hdev)
+{
+	struct ms_rdesc_fixup *f;
+	unsigned int i;
+
+	mutex_lock(&ms_rdesc_fw_lock);
+	for (i = 0; i < ms_rdesc_user_count; i++) {
+		f = &ms_rdesc_user_fixups[i];
+
+		if (!f->firmware || f->fw_tried)
+			continue;
+		if (f->product && f->product != hdev->product)
+			continue;
+
+		f->fw_tried = true;
+		if (request_firmware_direct(&f->fw, f->firmware, &hdev->dev)) {
+			hid_warn(hdev, "could not load report descriptor %s\n",
+				 f->firmware);
+			f->fw = NULL;
+		}
+	}
+	mutex_unlock(&ms_rdesc_fw_lock);
+}
+
+/* returns the patched or replaced descriptor, NULL if nothing applied */
+static __u8 *ms_rdesc_fixup_apply(struct hid_device *hdev,
+		const struct ms_rdesc_fixup *f, __u8 *rdesc,
+		unsigned int *rsize)
+{
+	unsigned int i;
+
+	if (f->replace)
+		return f->replace(hdev, rdesc, rsize);
+
+	if (f->firmware) {
+		if (!f->fw)
+			return NULL;
+		/* hid-core takes its own copy of the result */
+		*rsize = f->fw->size;
+		return (__u8 *)f->fw->data;
+	}
+
+	for (i = 0; i < f->npatches; i++)
+		rdesc[f->patches[i].offset] = f->patches[i].new;
+
+	return rdesc;
+}
+
+static __u8 *ms_report_fixup(struct hid_device *hdev, __u8 *rdesc,
+		unsigned int *rsize)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	const struct ms_rdesc_fixup *f;
+	u64 start = ktime_get_ns();
+	bool crc_valid = false;
+	unsigned int i;
+	__u8 *fixed;
+	u32 crc;
+
+	ms->rdesc_napplied = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ms_rdesc_fixups) + ms_rdesc_user_count; i++) {
+		f = i < ARRAY_SIZE(ms_rdesc_fixups) ? &ms_rdesc_fixups[i] :
+			&ms_rdesc_user_fixups[i - ARRAY_SIZE(ms_rdesc_fixups)];
+
+		if (!ms_rdesc_fixup_match(hdev, f, rdesc, *rsize, &crc,
+					  &crc_valid))
+			continue;
+
+		fixed = ms_rdesc_fixup_apply(hdev, f, rdesc, rsize);
+		if (!fixed)
+			continue;
+
+		hid_info(hdev, "fixing up report descriptor: %s\n", f->name);
+		if (ms->rdesc_napplied < ARRAY_SIZE(ms->rdesc_applied))
+			ms->rdesc_applied[ms->rdesc_napplied++] = f->name;
+
+		/* a replaced descriptor is final */
+		if (fixed != rdesc) {
+			rdesc = fixed;
+			break;
+		}
+		crc_valid = false;
 	}
+
+	ms->rdesc_fixup_ns = ktime_get_ns() - start;
 	return rdesc;
 }
 
+static int ms_rdesc_fixup_parse(struct ms_rdesc_fixup *f, char *param)
+{
+	struct ms_rdesc_patch *patches;
+	unsigned int product, n = 1;
+	char *spec, *tok;
+
+	/* the firmware name points into this copy */
+	f->spec = kstrdup(param, GFP_KERNEL);
+	if (!f->spec)
+		return -ENOMEM;
+
+	f->name = param;
+	spec = f->spec;
+
+	tok = strsep(&spec, ":");
+	if (kstrtouint(tok, 16, &product) || product > U16_MAX || !spec)
+		return -EINVAL;
+	f->product = product;
+
+	tok = strsep(&spec, ":");
+	if (kstrtouint(tok, 16, &f->size) || !spec)
+		return -EINVAL;
+
+	tok = strsep(&spec, ":");
+	if (kstrtou32(tok, 16, &f->crc) || !spec || !*spec)
+		return -EINVAL;
+
+	/* an entry that matches every device is almost certainly a typo */
+	if (!f->product && !f->size && !f->crc)
+		return -EINVAL;
+
+	if (str_has_prefix(spec, "fw=")) {
+		f->firmware = spec + 3;
+		return 0;
+	}
+
+	for (tok = spec; (tok = strchr(tok, ',')); tok++)
+		n++;
+
+	patches = kcalloc(n, sizeof(*patches), GFP_KERNEL);
+	if (!patches)
+		return -ENOMEM;
+	f->patches = patches;
+
+	while ((tok = strsep(&spec, ","))) {
+		if (sscanf(tok, "%x=%hhx>%hhx", &patches[f->npatches].offset,
+			   &patches[f->npatches].old,
+			   &patches[f->npatches].new) != 3)
+			return -EINVAL;
+		f->npatches++;
+	}
+
+	return 0;
+}
+
+static void ms_rdesc_fixup_free(struct ms_rdesc_fixup *f)
+{
+	release_firmware(f->fw);
+	kfree(f->patches);
+	kfree(f->spec);
+	memset(f, 0, sizeof(*f));
+}
+
+static void ms_rdesc_fixups_exit(void)
+{
+	while (ms_rdesc_user_count)
+		ms_rdesc_fixup_free(&ms_rdesc_user_fixups[--ms_rdesc_user_count]);
+}
+
+static void ms_rdesc_fixups_init(void)
+{
+	struct ms_rdesc_fixup *f;
+	int i, ret;
+
+	for (i = 0; i < rdesc_fixup_count; i++) {
+		f = &ms_rdesc_user_fixups[ms_rdesc_user_count];
+
+		ret = ms_rdesc_fixup_parse(f, rdesc_fixup[i]);
+		if (ret) {
+			pr_warn("ignoring report descriptor fixup \"%s\": %d\n",
+				rdesc_fixup[i], ret);
+			ms_rdesc_fixup_free(f);
+			continue;
+		}
+		ms_rdesc_user_count++;
+	}
+}
+
+static void ms_raw_usage_init(struct ms_raw_usage *ru, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage)
+{
+	ru->input = hi->input;
+	ru->report = field->report;
+	ru->offset = field->report_offset +
+		usage->usage_index * field->report_size;
+	ru->size = field->report_size;
+	ru->is_signed = field->logical_minimum < 0;
+}
+
+static bool ms_raw_usage_get(struct hid_device *hdev,
+		const struct ms_raw_usage *ru, struct hid_report *report,
+		u8 *data, int size, __u32 *value)
+{
+	if (!ru->input || ru->report != report)
+		return false;
+
+	if (report->id) {
+		data++;
+		size--;
+	}
+
+	if (size <= 0 || ru->offset + ru->size > size * 8)
+		return false;
+
+	*value = hid_field_extract(hdev, data, ru->offset, ru->size);
+	return true;
+}
+
+static s32 ms_raw_usage_sext(const struct ms_raw_usage *ru, __u32 value)
+{
+	return ru->is_signed ? sign_extend32(value, ru->size - 1) : value;
+}
+
+static const unsigned int ms_ergonomy_keypad_keys[] = {
+	KEY_KPEQUAL, KEY_KPLEFTPAREN, KEY_KPRIGHTPAREN,
+};
+
+static const unsigned int ms_ergonomy_fn_keys[] = {
+	KEY_F14, KEY_F15, KEY_F16, KEY_F17, KEY_F18,
+};
+
 #define ms_map_key_clear(c)	hid_map_usage_clear(hi, usage, bit, max, \
 					EV_KEY, (c))
-static int ms_ergonomy_kb_quirk(struct hid_input *hi, struct hid_usage *usage,
+static int ms_ergonomy_kb_quirk(struct ms_data *ms, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
 		unsigned long **bit, int *max)
 {
 	struct input_dev *input = hi->input;
+	unsigned int i;
 
 	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_CONSUMER) {
 		switch (usage->hid & HID_USAGE) {
@@ -105,16 +803,23 @@ static int ms_ergonomy_kb_quirk(struct hid_input *hi, struct hid_usage *usage,
 	switch (usage->hid & HID_USAGE) {
 	case 0xfd06: ms_map_key_clear(KEY_CHAT);	break;
 	case 0xfd07: ms_map_key_clear(KEY_PHONE);	break;
+	/*
+	 * The special keypad keys, the scroll wheel and the F13-F18 keys
+	 * are decoded per report in ms_ergonomy_raw_event(), so only set
+	 * up the capabilities here and keep hid-core away from them.
+	 */
 	case 0xff00:
 		/* Special keypad keys */
-		ms_map_key_clear(KEY_KPEQUAL);
-		set_bit(KEY_KPLEFTPAREN, input->keybit);
-		set_bit(KEY_KPRIGHTPAREN, input->keybit);
-		break;
+		for (i = 0; i < ARRAY_SIZE(ms_ergonomy_keypad_keys); i++)
+			input_set_capability(input, EV_KEY,
+					     ms_ergonomy_keypad_keys[i]);
+		ms_raw_usage_init(&ms->ergo_keypad, hi, field, usage);
+		return -1;
 	case 0xff01:
 		/* Scroll wheel */
-		hid_map_usage_clear(hi, usage, bit, max, EV_REL, REL_WHEEL);
-		break;
+		input_set_capability(input, EV_REL, REL_WHEEL);
+		ms_raw_usage_init(&ms->ergo_wheel, hi, field, usage);
+		return -1;
 	case 0xff02:
 		/*
 		 * This byte contains a copy of the modifier keys byte of a
@@ -127,13 +832,12 @@ static int ms_ergonomy_kb_quirk(struct hid_input *hi, struct hid_usage *usage,
 		return -1;
 	case 0xff05:
 		set_bit(EV_REP, input->evbit);
-		ms_map_key_clear(KEY_F13);
-		set_bit(KEY_F14, input->keybit);
-		set_bit(KEY_F15, input->keybit);
-		set_bit(KEY_F16, input->keybit);
-		set_bit(KEY_F17, input->keybit);
-		set_bit(KEY_F18, input->keybit);
-		break;
+		input_set_capability(input, EV_KEY, KEY_F13);
+		for (i = 0; i < ARRAY_SIZE(ms_ergonomy_fn_keys); i++)
+			input_set_capability(input, EV_KEY,
+					     ms_ergonomy_fn_keys[i]);
+		ms_raw_usage_init(&ms->ergo_fn, hi, field, usage);
+		return -1;
 	default:
 		return 0;
 	}
@@ -159,9 +863,41 @@ static int ms_presenter_8k_quirk(struct hid_input *hi, struct hid_usage *usage,
 	return 1;
 }
 
-static int ms_surface_dial_quirk(struct hid_input *hi, struct hid_field *field,
-		struct hid_usage *usage, unsigned long **bit, int *max)
+/*
+ * Dial units per detent, from the physical extent of the usage, which is
+ * expressed in degrees.
+ */
+static int ms_dial_units_per_detent(struct hid_field *field)
+{
+	s64 logical = (s64)field->logical_maximum - field->logical_minimum;
+	s64 physical = (s64)field->physical_maximum - field->physical_minimum;
+	s64 units = logical * MS_DIAL_DETENT_DEGREES;
+	int exponent = field->unit_exponent;
+
+	if (physical <= 0)
+		physical = logical;
+
+	for (; exponent < 0; exponent++)
+		units *= 10;
+	for (; exponent > 0; exponent--)
+		physical *= 10;
+
+	units = physical ? div64_s64(units, physical) : 0;
+
+	return clamp_t(s64, units, 1, INT_MAX);
+}
+
+static int ms_surface_dial_quirk(struct ms_data *ms, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
+		unsigned long **bit, int *max)
 {
+	/*
+	 * Only the dial collection is used, ignoring everything else keeps
+	 * hid-core from registering an input device per application.
+	 */
+	if (field->application != HID_GD_SYSTEM_MULTIAXIS)
+		return -1;
+
 	switch (usage->hid & HID_USAGE_PAGE) {
 	case 0xff070000:
 	case HID_UP_DIGITIZER:
@@ -174,12 +910,79 @@ static int ms_surface_dial_quirk(struct hid_input *hi, struct hid_field *field,
 		case HID_GD_RFKILL_BTN:
 			/* ignore those axis */
 			return -1;
+		case HID_GD_DIAL:
+			/* decoded by ms_dial_raw_event() */
+			if (ms->dial.dial.input || field->report_size > 32)
+				return 0;
+			input_set_capability(hi->input, EV_REL, REL_DIAL);
+			input_set_capability(hi->input, EV_REL, REL_WHEEL);
+			input_set_capability(hi->input, EV_REL,
+					     REL_WHEEL_HI_RES);
+			ms_raw_usage_init(&ms->dial.dial, hi, field, usage);
+			ms->dial.units_per_detent =
+				ms_dial_units_per_detent(field);
+			return -1;
 		}
 	}
 
 	return 0;
 }
 
+/*
+ * Motion, wheel and buttons are decoded by ms_mouse_raw_event(), only the
+ * first occurrence of each usage is taken, duplicates keep going through
+ * hid-core. ms_mouse_bypass() decides whether hid-core needs to see the
+ * report at all.
+ */
+static int ms_mouse_quirk(struct ms_data *ms, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage)
+{
+	struct ms_mouse *m = &ms->mouse;
+	struct ms_raw_usage *ru;
+	unsigned int code, type = EV_REL;
+
+	if (field->application != HID_GD_MOUSE ||
+			(m->report && m->report != field->report))
+		return 0;
+
+	switch (usage->hid) {
+	case HID_GD_X:
+		ru = &m->x;
+		code = REL_X;
+		break;
+	case HID_GD_Y:
+		ru = &m->y;
+		code = REL_Y;
+		break;
+	case HID_GD_WHEEL:
+		ru = &m->wheel;
+		code = REL_WHEEL;
+		break;
+	default:
+		if ((usage->hid & HID_USAGE_PAGE) != HID_UP_BUTTON ||
+				(usage->hid & HID_USAGE) < 1 ||
+				(usage->hid & HID_USAGE) > MS_MOUSE_BUTTONS)
+			return 0;
+		code = (usage->hid & HID_USAGE) - 1;
+		ru = &m->button[code];
+		code += BTN_MOUSE;
+		type = EV_KEY;
+		break;
+	}
+
+	if (ru->input || field->report_size > 32)
+		return 0;
+
+	input_set_capability(hi->input, type, code);
+	if (code == REL_WHEEL && type == EV_REL)
+		input_set_capability(hi->input, EV_REL, REL_WHEEL_HI_RES);
+	ms_raw_usage_init(ru, hi, field, usage);
+	m->input = hi->input;
+	m->report = field->report;
+
+	return -1;
+}
+
 #define ms_map_abs_clear(c)	hid_map_usage_clear(hi, usage, bit, max, \
 					EV_ABS, (c))
 static int ms_xbox_series_x_quirk(struct hid_input *hi, struct hid_field *field,
@@ -213,7 +1016,7 @@ static int ms_input_mapping(struct hid_device *hdev, struct hid_input *hi,
 	unsigned long quirks = ms->quirks;
 
 	if (quirks & MS_ERGONOMY) {
-		int ret = ms_ergonomy_kb_quirk(hi, usage, bit, max);
+		int ret = ms_ergonomy_kb_quirk(ms, hi, field, usage, bit, max);
 		if (ret)
 			return ret;
 	}
@@ -223,7 +1026,15 @@ static int ms_input_mapping(struct hid_device *hdev, struct hid_input *hi,
 		return 1;
 
 	if (quirks & MS_SURFACE_DIAL) {
-		int ret = ms_surface_dial_quirk(hi, field, usage, bit, max);
+		int ret = ms_surface_dial_quirk(ms, hi, field, usage, bit,
+						max);
+
+		if (ret)
+			return ret;
+	}
+
+	if ((quirks & MS_MOUSE) && ms->mouse.fast_path) {
+		int ret = ms_mouse_quirk(ms, hi, field, usage);
 
 		if (ret)
 			return ret;
@@ -250,160 +1061,2681 @@ static int ms_input_mapped(struct hid_device *hdev, struct hid_input *hi,
 	return 0;
 }
 
-static int ms_event(struct hid_device *hdev, struct hid_field *field,
-		struct hid_usage *usage, __s32 value)
+/*
+ * Only report the keys whose state differs from the previous report, most
+ * reports of these keyboards carry no change at all.
+ */
+static void ms_report_key_bitmap(struct input_dev *input,
+		const unsigned int *keys, unsigned int count,
+		__u8 old, __u8 new)
 {
-	struct ms_data *ms = hid_get_drvdata(hdev);
-	unsigned long quirks = ms->quirks;
-	struct input_dev *input;
+	unsigned long changed = (old ^ new) & GENMASK(count - 1, 0);
+	unsigned int i;
 
-	if (!(hdev->claimed & HID_CLAIMED_INPUT) || !field->hidinput ||
-			!usage->type)
-		return 0;
+	for_each_set_bit(i, &changed, count)
+		input_report_key(input, keys[i], new & BIT(i));
+}
 
-	input = field->hidinput->input;
+static void ms_ergonomy_raw_event(struct hid_device *hdev, struct ms_data *ms,
+		struct hid_report *report, u8 *data, int size)
+{
+	__u32 value;
 
-	/* Handling MS keyboards special buttons */
-	if (quirks & MS_ERGONOMY && usage->hid == (HID_UP_MSVENDOR | 0xff00)) {
+	if (ms_raw_usage_get(hdev, &ms->ergo_keypad, report, data, size,
+			     &value)) {
 		/* Special keypad keys */
-		input_report_key(input, KEY_KPEQUAL, value & 0x01);
-		input_report_key(input, KEY_KPLEFTPAREN, value & 0x02);
-		input_report_key(input, KEY_KPRIGHTPAREN, value & 0x04);
-		return 1;
+		ms_report_key_bitmap(ms->ergo_keypad.input,
+				     ms_ergonomy_keypad_keys,
+				     ARRAY_SIZE(ms_ergonomy_keypad_keys),
+				     ms->ergo_keypad_state, value);
+		ms->ergo_keypad_state = value;
 	}
 
-	if (quirks & MS_ERGONOMY && usage->hid == (HID_UP_MSVENDOR | 0xff01)) {
+	if (ms_raw_usage_get(hdev, &ms->ergo_wheel, report, data, size,
+			     &value)) {
 		/* Scroll wheel */
 		int step = ((value & 0x60) >> 5) + 1;
 
 		switch (value & 0x1f) {
 		case 0x01:
-			input_report_rel(input, REL_WHEEL, step);
+			input_report_rel(ms->ergo_wheel.input, REL_WHEEL, step);
 			break;
 		case 0x1f:
-			input_report_rel(input, REL_WHEEL, -step);
+			input_report_rel(ms->ergo_wheel.input, REL_WHEEL, -step);
 			break;
 		}
-		return 1;
 	}
 
-	if (quirks & MS_ERGONOMY && usage->hid == (HID_UP_MSVENDOR | 0xff05)) {
-		static unsigned int last_key = 0;
-		unsigned int key = 0;
-		switch (value) {
-		case 0x01: key = KEY_F14; break;
-		case 0x02: key = KEY_F15; break;
-		case 0x04: key = KEY_F16; break;
-		case 0x08: key = KEY_F17; break;
-		case 0x10: key = KEY_F18; break;
-		}
-		if (key) {
-			input_event(input, usage->type, key, 1);
-			last_key = key;
-		} else
-			input_event(input, usage->type, last_key, 0);
+	if (ms_raw_usage_get(hdev, &ms->ergo_fn, report, data, size,
+			     &value)) {
+		/* F14-F18, one bit per key */
+		ms_report_key_bitmap(ms->ergo_fn.input, ms_ergonomy_fn_keys,
+				     ARRAY_SIZE(ms_ergonomy_fn_keys),
+				     ms->ergo_fn_state, value);
+		ms->ergo_fn_state = value;
+	}
+}
 
-		return 1;
+/* called with m->lock held, returns whether anything was reported */
+static bool ms_mouse_emit(struct ms_mouse *m, ktime_t now)
+{
+	unsigned long changed = m->buttons ^ m->buttons_sent;
+	unsigned int i;
+
+	if (!changed && !m->dx && !m->dy && !m->dwheel)
+		return false;
+
+	if (m->dx)
+		input_report_rel(m->input, REL_X, m->dx);
+	if (m->dy)
+		input_report_rel(m->input, REL_Y, m->dy);
+	if (m->dwheel) {
+		input_report_rel(m->input, REL_WHEEL, m->dwheel);
+		input_report_rel(m->input, REL_WHEEL_HI_RES, m->dwheel * 120);
+	}
+	for_each_set_bit(i, &changed, MS_MOUSE_BUTTONS)
+		input_report_key(m->input, BTN_MOUSE + i, m->buttons & BIT(i));
+
+	m->dx = 0;
+	m->dy = 0;
+	m->dwheel = 0;
+	m->buttons_sent = m->buttons;
+	m->last_flush = now;
+
+	return true;
+}
+
+/*
+ * Flush from outside the report path, called with m->lock held. While
+ * hid-core is in the middle of a report the flush is left to ms_report(),
+ * so a sync from here never splits the events of a report.
+ */
+static void ms_mouse_flush(struct ms_mouse *m)
+{
+	if (m->in_report) {
+		m->flush = true;
+		return;
+	}
+
+	if (ms_mouse_emit(m, ktime_get()))
+		input_sync(m->input);
+}
+
+static enum hrtimer_restart ms_mouse_timer(struct hrtimer *timer)
+{
+	struct ms_mouse *m = container_of(timer, struct ms_mouse, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&m->lock, flags);
+	ms_mouse_flush(m);
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* keeps the timer from being armed again, before the input goes away */
+static void ms_mouse_stop(struct ms_mouse *m)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&m->lock, flags);
+	m->stopped = true;
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	hrtimer_cancel(&m->timer);
+}
+
+/* whether hid-input still reports @usage, i.e. kept its capability */
+static bool ms_usage_reported(struct hid_field *field, struct hid_usage *usage)
+{
+	struct input_dev *input;
+
+	if (!usage->type || !field->hidinput)
+		return false;
+
+	input = field->hidinput->input;
+	switch (usage->type) {
+	case EV_KEY:
+		return test_bit(usage->code, input->keybit);
+	case EV_REL:
+		return test_bit(usage->code, input->relbit);
+	case EV_ABS:
+		return test_bit(usage->code, input->absbit);
+	case EV_MSC:
+		return test_bit(usage->code, input->mscbit);
+	default:
+		return true;
+	}
+}
+
+/*
+ * The decoded report skips hid-core's field walk if the driver reports
+ * everything in it: no other usage of it makes it to hid-input, and
+ * hiddev doesn't listen. The Comfort Mouse 4500 only has duplicates
+ * besides, which MS_DUPLICATE_USAGES drops anyway. hidraw is still fed
+ * by ms_mouse_raw_event(), the HID debug events of its fields are not.
+ */
+static bool ms_mouse_bypass(struct hid_device *hdev, struct ms_mouse *m)
+{
+	struct hid_field *field;
+	unsigned int i, j;
+
+	if (!m->input || (hdev->claimed & HID_CLAIMED_HIDDEV))
+		return false;
+
+	for (i = 0; i < m->report->maxfield; i++) {
+		field = m->report->field[i];
+		for (j = 0; j < field->maxusage; j++)
+			if (ms_usage_reported(field, &field->usage[j]))
+				return false;
+	}
+
+	return true;
+}
+
+/* called with m->lock held */
+static void ms_mouse_decode(struct hid_device *hdev, struct ms_mouse *m,
+		struct hid_report *report, u8 *data, int size)
+{
+	unsigned int interval = READ_ONCE(mouse_interval_us);
+	unsigned int i;
+	__u32 value;
+	ktime_t now;
+
+	if (ms_raw_usage_get(hdev, &m->x, report, data, size, &value))
+		m->dx += ms_raw_usage_sext(&m->x, value);
+	if (ms_raw_usage_get(hdev, &m->y, report, data, size, &value))
+		m->dy += ms_raw_usage_sext(&m->y, value);
+	if (ms_raw_usage_get(hdev, &m->wheel, report, data, size, &value))
+		m->dwheel += ms_raw_usage_sext(&m->wheel, value);
+
+	for (i = 0; i < MS_MOUSE_BUTTONS; i++) {
+		if (!ms_raw_usage_get(hdev, &m->button[i], report, data, size,
+				      &value))
+			continue;
+		if (value)
+			m->buttons |= BIT(i);
+		else
+			m->buttons &= ~BIT(i);
+	}
+
+	now = ktime_get();
+	if (!interval || m->stopped || m->buttons != m->buttons_sent ||
+			ktime_us_delta(now, m->last_flush) >= interval) {
+		hrtimer_try_to_cancel(&m->timer);
+		m->flush = true;
+	} else if (!hrtimer_is_queued(&m->timer)) {
+		hrtimer_start(&m->timer, ktime_add_us(m->last_flush, interval),
+			      HRTIMER_MODE_ABS);
+	}
+}
+
+/*
+ * With mouse_interval_us set, motion of the reports arriving within one
+ * interval is summed up and reported once, the remainder of a burst is
+ * flushed by the timer. Button changes are never delayed.
+ *
+ * A bypassed report is passed on to hidraw, reported and synced here,
+ * and hid-core stops at the negative return.
+ *
+ * Otherwise hid-core doesn't sync the input devices of the mouse,
+ * ms_report() does once the whole report went through hid-input. Every
+ * report marks the input busy until then, as other collections may
+ * share it.
+ */
+static int ms_mouse_raw_event(struct hid_device *hdev, struct ms_data *ms,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct ms_mouse *m = &ms->mouse;
+	unsigned long flags;
+
+	if (!m->input)
+		return 0;
+
+	if (report == m->report && READ_ONCE(m->bypass)) {
+		if (hdev->claimed & HID_CLAIMED_HIDRAW)
+			hidraw_report_event(hdev, data, size);
+
+		spin_lock_irqsave(&m->lock, flags);
+		ms_mouse_decode(hdev, m, report, data, size);
+		if (m->flush)
+			ms_mouse_emit(m, ktime_get());
+		m->flush = false;
+		input_sync(m->input);
+		m->report_ns += ktime_get_ns() - m->report_start;
+		m->reports++;
+		spin_unlock_irqrestore(&m->lock, flags);
+		return -1;
+	}
+
+	spin_lock_irqsave(&m->lock, flags);
+	m->in_report = true;
+	if (report == m->report)
+		ms_mouse_decode(hdev, m, report, data, size);
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	return 0;
+}
+
+/* the end of a report, see ms_mouse_raw_event() */
+static void ms_mouse_report(struct hid_device *hdev, struct ms_data *ms)
+{
+	struct ms_mouse *m = &ms->mouse;
+	struct hid_input *hidinput;
+	unsigned long flags;
+
+	spin_lock_irqsave(&m->lock, flags);
+	if (m->input) {
+		if (m->flush)
+			ms_mouse_emit(m, ktime_get());
+		m->flush = false;
+		m->in_report = false;
+		input_sync(m->input);
+	}
+	m->report_ns += ktime_get_ns() - m->report_start;
+	m->reports++;
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	/* HID_QUIRK_NO_INPUT_SYNC is set before anything got decoded */
+	if (!m->fast_path)
+		return;
+
+	list_for_each_entry(hidinput, &hdev->inputs, list) {
+		if (hidinput->input != m->input)
+			input_sync(hidinput->input);
+	}
+}
+
+/*
+ * Report the rotation of one report as a single REL_DIAL in device units
+ * and as REL_WHEEL_HI_RES with 120 units per detent, clockwise scrolling
+ * down, see ms_dial_rotate().
+ */
+static void ms_dial_raw_event(struct hid_device *hdev, struct ms_data *ms,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct ms_dial *d = &ms->dial;
+	struct input_dev *input = d->dial.input;
+	int value, hires, wheel;
+	__u32 raw;
+
+	if (!ms_raw_usage_get(hdev, &d->dial, report, data, size, &raw))
+		return;
+
+	value = ms_raw_usage_sext(&d->dial, raw);
+	if (!value)
+		return;
+
+	input_report_rel(input, REL_DIAL, value);
+
+	ms_dial_rotate(&d->rem, value, d->units_per_detent, &hires, &wheel);
+	if (hires)
+		input_report_rel(input, REL_WHEEL_HI_RES, hires);
+	if (wheel)
+		input_report_rel(input, REL_WHEEL, wheel);
+}
+
+/*
+ * Every FF send goes through this one workqueue. A work item queued on two
+ * of them could run on both at once and share the output report buffer.
+ */
+static void ms_ff_queue(struct ms_data *ms)
+{
+	queue_work(system_highpri_wq, &ms->ff_worker);
+}
+
+/* a gap this many periods long means the controller went quiet */
+#define MS_FF_ALIGN_GAP		2
+/* intervals up to this many periods long count as skipped reports */
+#define MS_FF_ALIGN_MAX_SKIP	4
+
+/*
+ * Nothing is learned while ff_align_us is 0, so devices that don't align
+ * pay no lock or clock read per input report. The stale cadence is
+ * dropped as a gap on the first report after it is set again.
+ */
+static void ms_ff_align_report(struct ms_data *ms)
+{
+	struct ms_ff_align *a = &ms->ff_align;
+	struct ms_ff_align_stats *st = &a->stats;
+	u64 now, interval, skips, dev;
+	unsigned long flags;
+
+	if (!READ_ONCE(ff_align_us))
+		return;
+
+	now = ktime_get_ns();
+	spin_lock_irqsave(&a->lock, flags);
+	interval = now - a->last_ns;
+	skips = a->period_ns ?
+		max_t(u64, DIV_ROUND_CLOSEST_ULL(interval, a->period_ns), 1) : 0;
+
+	if (!a->period_ns) {
+		if (a->last_ns && interval < NSEC_PER_SEC / 10)
+			a->period_ns = interval;
+	} else if (skips <= MS_FF_ALIGN_MAX_SKIP) {
+		/*
+		 * A report the controller skipped, or one lost on the link,
+		 * would pull the period down if left out and up if taken
+		 * whole, so the interval is split into the periods it spans.
+		 */
+		interval = div64_u64(interval, skips);
+		dev = abs_diff(interval, a->period_ns);
+		if (a->sent_ns > a->last_ns) {
+			st->ff_intervals++;
+			st->ff_jitter_ns += dev;
+			st->ff_jitter_max_ns = max(st->ff_jitter_max_ns, dev);
+		} else {
+			st->intervals++;
+			st->jitter_ns += dev;
+			st->jitter_max_ns = max(st->jitter_max_ns, dev);
+		}
+		/* the new interval weighs 1/8 */
+		a->period_ns = a->period_ns - (a->period_ns >> 3) +
+			(interval >> 3);
+	}
+	a->last_ns = now;
+
+	if (a->waiting) {
+		a->waiting = false;
+		a->released_ns = now;
+		st->aligned++;
+		hrtimer_try_to_cancel(&a->timer);
+		ms_ff_queue(ms);
+	}
+	spin_unlock_irqrestore(&a->lock, flags);
+}
+
+static enum hrtimer_restart ms_ff_align_timer(struct hrtimer *timer)
+{
+	struct ms_data *ms = container_of(timer, struct ms_data,
+					  ff_align.timer);
+	struct ms_ff_align *a = &ms->ff_align;
+	unsigned long flags;
+
+	spin_lock_irqsave(&a->lock, flags);
+	if (a->waiting) {
+		a->waiting = false;
+		a->stats.fallbacks++;
+		ms_ff_queue(ms);
+	}
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Queue an FF send. With ff_align_us set and the controller reporting at
+ * a steady rate, the send waits for the next input report if that is
+ * expected within the budget, and that report queues it. The worker still
+ * has to run before the output report goes out; how long that takes is
+ * in report_to_send of the ff_align debugfs file, and aligning only helps
+ * while it stays well below the period.
+ */
+static void ms_ff_kick(struct ms_data *ms)
+{
+	struct ms_ff_align *a = &ms->ff_align;
+	u64 budget = (u64)READ_ONCE(ff_align_us) * NSEC_PER_USEC;
+	u64 now = ktime_get_ns(), next;
+	unsigned long flags;
+
+	spin_lock_irqsave(&a->lock, flags);
+	if (!a->requested_ns)
+		a->requested_ns = now;
+
+	if (a->waiting) {
+		spin_unlock_irqrestore(&a->lock, flags);
+		return;
+	}
+
+	if (budget && a->period_ns &&
+	    now - a->last_ns < MS_FF_ALIGN_GAP * a->period_ns) {
+		next = a->last_ns + a->period_ns;
+		if (next < now)
+			next = now;
+		if (next - now <= budget) {
+			a->waiting = true;
+			hrtimer_start(&a->timer, ns_to_ktime(budget),
+				      HRTIMER_MODE_REL_SOFT);
+			spin_unlock_irqrestore(&a->lock, flags);
+			return;
+		}
 	}
+	spin_unlock_irqrestore(&a->lock, flags);
+
+	ms_ff_queue(ms);
+}
+
+static int ms_gamepad_raw_event(struct hid_device *hdev, struct ms_data *ms,
+		struct hid_report *report, u8 *data, int size);
+
+static int ms_raw_event(struct hid_device *hdev, struct hid_report *report,
+		u8 *data, int size)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+
+	if (unlikely(!ms->timing.first_event))
+		ms->timing.first_event = ktime_get_ns() - ms->timing.start;
+
+	if (unlikely(READ_ONCE(ms->timing.resume_start))) {
+		ms->timing.resume_first_event = ktime_get_ns() -
+			ms->timing.resume_start;
+		WRITE_ONCE(ms->timing.resume_start, 0);
+	}
+
+	if (ms->quirks & MS_MOUSE)
+		ms->mouse.report_start = ktime_get_ns();
+
+	if ((ms->quirks & MS_QUIRK_FF) && report->id == XBOX_INPUT_REPORT)
+		ms_ff_align_report(ms);
+
+	if (ms->gamepad)
+		return ms_gamepad_raw_event(hdev, ms, report, data, size);
+
+	if (!(hdev->claimed & HID_CLAIMED_INPUT))
+		return 0;
+
+	if ((ms->quirks & MS_MOUSE) && ms->mouse.fast_path &&
+	    ms_mouse_raw_event(hdev, ms, report, data, size))
+		return -1;
+
+	if (ms->quirks & MS_SURFACE_DIAL)
+		ms_dial_raw_event(hdev, ms, report, data, size);
+
+	/*
+	 * Events reported here are synced by hid-core together with the
+	 * rest of the report.
+	 */
+	if (ms->quirks & MS_ERGONOMY)
+		ms_ergonomy_raw_event(hdev, ms, report, data, size);
+
+	return 0;
+}
+
+static void ms_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+
+	if (ms->quirks & MS_MOUSE)
+		ms_mouse_report(hdev, ms);
+}
+
+static int ms_mouse_stats_show(struct seq_file *s, void *unused)
+{
+	struct ms_data *ms = s->private;
+	struct ms_mouse *m = &ms->mouse;
+	unsigned long flags;
+	u64 reports, report_ns;
+
+	spin_lock_irqsave(&m->lock, flags);
+	reports = m->reports;
+	report_ns = m->report_ns;
+	spin_unlock_irqrestore(&m->lock, flags);
+
+	seq_printf(s, "path:\t\t%s\n", !m->input ? "hid-input" :
+		   READ_ONCE(m->bypass) ? "driver, bypassing hid-core" :
+		   "driver");
+	seq_printf(s, "reports:\t%llu\n", reports);
+	seq_printf(s, "total_ns:\t%llu\n", report_ns);
+	seq_printf(s, "ns_per_report:\t%llu\n",
+		   reports ? div64_u64(report_ns, reports) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_mouse_stats);
+
+static int ms_gamepad_stats_show(struct seq_file *s, void *unused)
+{
+	struct ms_data *ms = s->private;
+	struct ms_gamepad *gp = ms->gamepad;
+	struct xbox_burst_stats b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gp->lock, flags);
+	b = gp->burst;
+	spin_unlock_irqrestore(&gp->lock, flags);
+
+	seq_printf(s, "reports:\t%llu\n", b.reports);
+	seq_printf(s, "buffer_size:\t%u\n", b.buffer_size);
+	seq_printf(s, "max_burst:\t%u\n", b.max_events);
+	seq_printf(s, "bursts_over_buffer:\t%llu\n", b.over_buffer);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_gamepad_stats);
+
+static int ms_ff_align_show(struct seq_file *s, void *unused)
+{
+	struct ms_data *ms = s->private;
+	struct ms_ff_align_stats a;
+	unsigned long flags;
+	u64 period;
+
+	spin_lock_irqsave(&ms->ff_align.lock, flags);
+	a = ms->ff_align.stats;
+	period = ms->ff_align.period_ns;
+	spin_unlock_irqrestore(&ms->ff_align.lock, flags);
+
+	seq_printf(s, "budget_us:\t%u\n", READ_ONCE(ff_align_us));
+	seq_printf(s, "period_ns:\t%llu\n", period);
+	seq_printf(s, "intervals:\t%llu\n", a.intervals);
+	seq_printf(s, "jitter_avg_ns:\t%llu\n",
+		   a.intervals ? div64_u64(a.jitter_ns, a.intervals) : 0);
+	seq_printf(s, "jitter_max_ns:\t%llu\n", a.jitter_max_ns);
+	seq_printf(s, "ff_intervals:\t%llu\n", a.ff_intervals);
+	seq_printf(s, "ff_jitter_avg_ns:\t%llu\n",
+		   a.ff_intervals ?
+		   div64_u64(a.ff_jitter_ns, a.ff_intervals) : 0);
+	seq_printf(s, "ff_jitter_max_ns:\t%llu\n", a.ff_jitter_max_ns);
+	seq_printf(s, "sends:\t%llu\n", a.sends);
+	seq_printf(s, "aligned:\t%llu\n", a.aligned);
+	seq_printf(s, "fallbacks:\t%llu\n", a.fallbacks);
+	seq_printf(s, "latency_avg_ns:\t%llu\n",
+		   a.sends ? div64_u64(a.latency_ns, a.sends) : 0);
+	seq_printf(s, "latency_max_ns:\t%llu\n", a.latency_max_ns);
+	seq_printf(s, "report_to_send_avg_ns:\t%llu\n",
+		   a.report_to_sends ?
+		   div64_u64(a.report_to_send_ns, a.report_to_sends) : 0);
+	seq_printf(s, "report_to_send_max_ns:\t%llu\n",
+		   a.report_to_send_max_ns);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_ff_align);
+
+static int ms_rdesc_fixups_show(struct seq_file *s, void *unused)
+{
+	struct ms_data *ms = s->private;
+	struct hid_device *hdev = ms->hdev;
+	unsigned int i;
+
+	seq_printf(s, "original:\t%u bytes, crc32 %08x\n", hdev->dev_rsize,
+		   ~crc32_le(~0, hdev->dev_rdesc, hdev->dev_rsize));
+	seq_printf(s, "match_ns:\t%llu\n", ms->rdesc_fixup_ns);
+	for (i = 0; i < ms->rdesc_napplied; i++)
+		seq_printf(s, "applied:\t%s\n", ms->rdesc_applied[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_rdesc_fixups);
+
+static int ms_probe_timing_show(struct seq_file *s, void *unused)
+{
+	struct ms_data *ms = s->private;
+	struct ms_probe_timing *t = &ms->timing;
+
+	seq_printf(s, "parse_ns:\t%llu\n", t->parse);
+	seq_printf(s, "hw_start_ns:\t%llu\n", t->hw_start);
+	seq_printf(s, "input_ns:\t%llu\n", t->input);
+	seq_printf(s, "probe_ns:\t%llu\n", t->total);
+	seq_printf(s, "first_event_ns:\t%llu\n", t->first_event);
+	seq_printf(s, "resumes:\t%u\n", t->resumes);
+	seq_printf(s, "resume_first_event_ns:\t%llu\n", t->resume_first_event);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_probe_timing);
+
+static void ms_debugfs_init(struct hid_device *hdev)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+
+	if (!hdev->debug_dir)
+		return;
+
+	ms->debugfs = debugfs_create_dir("microsoft", hdev->debug_dir);
+
+	debugfs_create_file("rdesc_fixups", 0444, ms->debugfs, ms,
+			    &ms_rdesc_fixups_fops);
+	debugfs_create_file("probe_timing", 0444, ms->debugfs, ms,
+			    &ms_probe_timing_fops);
+
+	if (ms->quirks & MS_MOUSE)
+		debugfs_create_file("mouse_stats", 0444, ms->debugfs, ms,
+				    &ms_mouse_stats_fops);
+
+	if (ms->gamepad)
+		debugfs_create_file("gamepad_stats", 0444, ms->debugfs, ms,
+				    &ms_gamepad_stats_fops);
+
+	if (ms->quirks & MS_QUIRK_FF)
+		debugfs_create_file("ff_align", 0444, ms->debugfs, ms,
+				    &ms_ff_align_fops);
+}
+
+/* every device with the FF quirk, for rumble groups */
+static LIST_HEAD(ms_ff_devices);
+static DEFINE_MUTEX(ms_ff_lock);
+
+static void ms_ff_fill(struct xb1s_ff_report *r, u8 strong, u8 weak,
+		u8 duration_10ms, u8 loop_count)
+{
+	memset(r, 0, sizeof(*r));
+
+	r->report_id = XB1S_FF_REPORT;
+	r->enable = ENABLE_WEAK | ENABLE_STRONG;
+	r->duration_10ms = duration_10ms;
+	r->loop_count = loop_count;
+	r->magnitude[MAGNITUDE_STRONG] = strong; /* left actuator */
+	r->magnitude[MAGNITUDE_WEAK] = weak;     /* right actuator */
+}
+
+/*
+ * Request to send latency, and input report to send latency of aligned
+ * sends, counted once the report went out.
+ */
+static void ms_ff_align_sent(struct ms_ff_align *a)
+{
+	struct ms_ff_align_stats *st = &a->stats;
+	u64 now = ktime_get_ns(), latency;
+	unsigned long flags;
+
+	spin_lock_irqsave(&a->lock, flags);
+	if (a->requested_ns) {
+		latency = now - a->requested_ns;
+		st->sends++;
+		st->latency_ns += latency;
+		st->latency_max_ns = max(st->latency_max_ns, latency);
+		a->requested_ns = 0;
+	}
+	if (a->released_ns) {
+		latency = now - a->released_ns;
+		st->report_to_sends++;
+		st->report_to_send_ns += latency;
+		st->report_to_send_max_ns = max(st->report_to_send_max_ns,
+						latency);
+		a->released_ns = 0;
+	}
+	a->sent_ns = now;
+	spin_unlock_irqrestore(&a->lock, flags);
+}
+
+/*
+ * The output report buffer is allocated on first use, the first effect
+ * upload, rumble restored on reconnect or a haptics ring, so probe
+ * doesn't wait for it. Only called where sleeping is fine.
+ */
+static int ms_ff_prepare(struct ms_data *ms)
+{
+	struct xb1s_ff_report *r;
+
+	if (smp_load_acquire(&ms->output_report_dmabuf))
+		return 0;
+
+	r = devm_kzalloc(&ms->hdev->dev, sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	if (cmpxchg_release(&ms->output_report_dmabuf, NULL, r))
+		devm_kfree(&ms->hdev->dev, r);
 
 	return 0;
 }
 
 static void ms_ff_worker(struct work_struct *work)
 {
-	struct ms_data *ms = container_of(work, struct ms_data, ff_worker);
-	struct hid_device *hdev = ms->hdev;
-	struct xb1s_ff_report *r = ms->output_report_dmabuf;
+	struct ms_data *ms = container_of(work, struct ms_data, ff_worker);
+	struct hid_device *hdev = ms->hdev;
+	struct xb1s_ff_report *r = smp_load_acquire(&ms->output_report_dmabuf);
+	u8 strong, weak, left, right;
+	unsigned long flags;
+	bool triggers;
+	int ret;
+
+	/* resume sends the current state again */
+	if (READ_ONCE(ms->suspended) || !r)
+		return;
+
+	spin_lock_irqsave(&ms->ff_lock, flags);
+	strong = ms->strong;
+	weak = ms->weak;
+	left = ms->left_trigger;
+	right = ms->right_trigger;
+	triggers = ms->triggers;
+	ms->triggers = left || right;
+	spin_unlock_irqrestore(&ms->ff_lock, flags);
+
+	/*
+	 * Specifying maximum duration and maximum loop count should
+	 * cover maximum duration of a single effect, which is 65536
+	 * ms
+	 */
+	ms_ff_fill(r, strong, weak, U8_MAX, U8_MAX);
+
+	/* the trigger motors are left alone until somebody uses them */
+	if (left || right || triggers) {
+		r->enable |= ENABLE_LEFT_TRIGGER | ENABLE_RIGHT_TRIGGER;
+		r->magnitude[MAGNITUDE_LEFT_TRIGGER] = left;
+		r->magnitude[MAGNITUDE_RIGHT_TRIGGER] = right;
+	}
+
+	ret = hid_hw_output_report(hdev, (__u8 *)r, sizeof(*r));
+	if (ret < 0)
+		hid_warn(hdev, "failed to send FF report\n");
+
+	ms_ff_align_sent(&ms->ff_align);
+}
+
+static int ms_play_effect(struct input_dev *dev, void *data,
+			  struct ff_effect *effect)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct ms_data *ms = hid_get_drvdata(hid);
+	unsigned long flags;
+
+	if (effect->type != FF_RUMBLE)
+		return 0;
+
+	/* an open haptics ring has the motors, see ms_haptics_open() */
+	if (READ_ONCE(ms->haptics_owned))
+		return 0;
+
+	/*
+	 * Magnitude is 0..100 so scale the 16-bit input here
+	 */
+	spin_lock_irqsave(&ms->ff_lock, flags);
+	ms->strong = ((u32) effect->u.rumble.strong_magnitude * 100) / U16_MAX;
+	ms->weak = ((u32) effect->u.rumble.weak_magnitude * 100) / U16_MAX;
+	spin_unlock_irqrestore(&ms->ff_lock, flags);
+
+	ms_ff_kick(ms);
+	return 0;
+}
+
+/* EVIOCSFF fails with -ENOMEM if there is no buffer to send with */
+static int ms_ff_upload(struct input_dev *dev, struct ff_effect *effect,
+			struct ff_effect *old)
+{
+	struct hid_device *hid = input_get_drvdata(dev);
+	struct ms_data *ms = hid_get_drvdata(hid);
+	int ret;
+
+	ret = ms_ff_prepare(ms);
+	if (ret)
+		return ret;
+
+	return ms->ff_upload(dev, effect, old);
+}
+
+static int ms_init_ff(struct hid_device *hdev)
+{
+	struct hid_input *hidinput;
+	struct input_dev *input_dev;
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	int ret;
+
+	if (list_empty(&hdev->inputs)) {
+		hid_err(hdev, "no inputs found\n");
+		return -ENODEV;
+	}
+	hidinput = list_entry(hdev->inputs.next, struct hid_input, list);
+	input_dev = hidinput->input;
+
+	if (!(ms->quirks & MS_QUIRK_FF))
+		return 0;
+
+	input_set_capability(input_dev, EV_FF, FF_RUMBLE);
+	ret = input_ff_create_memless(input_dev, NULL, ms_play_effect);
+	if (ret)
+		return ret;
+
+	ms->ff_upload = input_dev->ff->upload;
+	input_dev->ff->upload = ms_ff_upload;
+	return 0;
+}
+
+static void ms_remove_ff(struct hid_device *hdev)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+
+	if (!(ms->quirks & MS_QUIRK_FF))
+		return;
+
+	hrtimer_cancel(&ms->ff_align.timer);
+	cancel_work_sync(&ms->ff_worker);
+}
+
+static DEFINE_IDA(ms_haptics_ida);
+
+/* hands the motors to the FF worker, called with hp->lock held */
+static void ms_haptics_play(struct ms_haptics *hp,
+		const struct ms_haptics_frame *f)
+{
+	struct ms_data *ms = hp->ms;
+	unsigned long flags;
+
+	if (!ms || READ_ONCE(ms->suspended))
+		return;
+
+	spin_lock_irqsave(&ms->ff_lock, flags);
+	ms->strong = min_t(u8, f->strong, 100);
+	ms->weak = min_t(u8, f->weak, 100);
+	ms->left_trigger = min_t(u8, f->left_trigger, 100);
+	ms->right_trigger = min_t(u8, f->right_trigger, 100);
+	spin_unlock_irqrestore(&ms->ff_lock, flags);
+	ms_ff_queue(ms);
+}
+
+/*
+ * Runs when the next frame is due. With the ring empty it marks the ring
+ * idle and stops, the producer rings the doorbell for the next frame.
+ * The decision to stop or re-arm is taken under hp->lock, which the
+ * doorbell holds to start the timer, so the two never both arm it.
+ */
+static enum hrtimer_restart ms_haptics_timer(struct hrtimer *timer)
+{
+	struct ms_haptics *hp = container_of(timer, struct ms_haptics, timer);
+	struct ms_haptics_ring *ring = hp->ring;
+	struct ms_haptics_frame f, play = {};
+	u64 now = ktime_get_ns(), next = 0;
+	unsigned int dropped = 0;
+	bool due = false;
+	u32 head;
+
+	head = smp_load_acquire(&ring->head);
+
+	/* a producer ahead by more than the ring restarted, catch up */
+	if (head - hp->tail > MS_HAPTICS_FRAMES) {
+		dropped += head - hp->tail - MS_HAPTICS_FRAMES;
+		hp->tail = head - MS_HAPTICS_FRAMES;
+	}
+
+	while (hp->tail != head) {
+		f = ring->frames[hp->tail % MS_HAPTICS_FRAMES];
+		if (f.time_ns > now) {
+			next = f.time_ns;
+			break;
+		}
+		dropped += due;
+		play = f;
+		due = true;
+		hp->tail++;
+	}
+
+	if (due && now - play.time_ns > MS_HAPTICS_LATE_NS) {
+		dropped++;
+		due = false;
+	}
+
+	if (dropped)
+		WRITE_ONCE(ring->dropped, ring->dropped + dropped);
+	smp_store_release(&ring->tail, hp->tail);
+
+	spin_lock(&hp->lock);
+	if (due) {
+		ms_haptics_play(hp, &play);
+		WRITE_ONCE(ring->played, ring->played + 1);
+	}
+
+	if (!next) {
+		/*
+		 * Pairs with the barrier between publishing head and reading
+		 * idle in the producer: either it sees idle and rings, or
+		 * this sees its frame.
+		 */
+		WRITE_ONCE(ring->idle, 1);
+		smp_mb();
+		if (READ_ONCE(ring->head) == hp->tail) {
+			hp->armed = false;
+			spin_unlock(&hp->lock);
+			return HRTIMER_NORESTART;
+		}
+		WRITE_ONCE(ring->idle, 0);
+		next = now;
+	}
+
+	/* armed, so the doorbell can't have queued it behind our back */
+	hrtimer_set_expires(timer, ns_to_ktime(next));
+	spin_unlock(&hp->lock);
+	return HRTIMER_RESTART;
+}
+
+static void ms_haptics_free(struct kref *kref)
+{
+	struct ms_haptics *hp = container_of(kref, struct ms_haptics, kref);
+
+	/* existing mappings hold a reference of their own on the page */
+	__free_page(hp->page);
+	ida_free(&ms_haptics_ida, hp->minor_id);
+	kfree(hp);
+}
+
+static int ms_haptics_open(struct inode *inode, struct file *file)
+{
+	struct ms_haptics *hp = container_of(file->private_data,
+					     struct ms_haptics, misc);
+
+	/* misc_open() holds misc_mtx, so hp can't be deregistered yet */
+	kref_get(&hp->kref);
+	file->private_data = hp;
+
+	mutex_lock(&hp->mutex);
+	if (!hp->users++) {
+		/* frames queued while nobody had the node open are stale */
+		hp->tail = READ_ONCE(hp->ring->head);
+		WRITE_ONCE(hp->ring->tail, hp->tail);
+		WRITE_ONCE(hp->ring->idle, 1);
+
+		/* the ring has the motors until the last file is closed */
+		spin_lock_bh(&hp->lock);
+		if (hp->ms)
+			WRITE_ONCE(hp->ms->haptics_owned, true);
+		spin_unlock_bh(&hp->lock);
+	}
+	mutex_unlock(&hp->mutex);
+
+	return 0;
+}
+
+static int ms_haptics_release(struct inode *inode, struct file *file)
+{
+	static const struct ms_haptics_frame stop;
+	struct ms_haptics *hp = file->private_data;
+
+	mutex_lock(&hp->mutex);
+	if (!--hp->users) {
+		hrtimer_cancel(&hp->timer);
+		spin_lock_bh(&hp->lock);
+		hp->armed = false;
+		ms_haptics_play(hp, &stop);
+		if (hp->ms)
+			WRITE_ONCE(hp->ms->haptics_owned, false);
+		spin_unlock_bh(&hp->lock);
+	}
+	mutex_unlock(&hp->mutex);
+
+	kref_put(&hp->kref, ms_haptics_free);
+	return 0;
+}
+
+/*
+ * The doorbell, any write wakes an idle ring. The timer is only started
+ * here when it has disarmed itself, a running callback that finds the
+ * new frame re-arms on its own.
+ */
+static ssize_t ms_haptics_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct ms_haptics *hp = file->private_data;
+
+	if (!READ_ONCE(hp->ring->idle))
+		return count;
+
+	spin_lock_bh(&hp->lock);
+	if (!hp->armed) {
+		hp->armed = true;
+		WRITE_ONCE(hp->ring->idle, 0);
+		hrtimer_start(&hp->timer, 0, HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_bh(&hp->lock);
+
+	return count;
+}
+
+static int ms_haptics_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ms_haptics *hp = file->private_data;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1)
+		return -EINVAL;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	return vm_insert_page(vma, vma->vm_start, hp->page);
+}
+
+static const struct file_operations ms_haptics_fops = {
+	.owner = THIS_MODULE,
+	.open = ms_haptics_open,
+	.release = ms_haptics_release,
+	.write = ms_haptics_write,
+	.mmap = ms_haptics_mmap,
+	.llseek = noop_llseek,
+};
+
+static struct ms_haptics *ms_haptics_create(struct ms_data *ms)
+{
+	struct ms_haptics *hp;
+	int ret;
+
+	ret = ms_ff_prepare(ms);
+	if (ret)
+		return ERR_PTR(ret);
+
+	hp = kzalloc(sizeof(*hp), GFP_KERNEL);
+	if (!hp)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&hp->kref);
+	mutex_init(&hp->mutex);
+	spin_lock_init(&hp->lock);
+	hrtimer_init(&hp->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	hp->timer.function = ms_haptics_timer;
+	hp->ms = ms;
+
+	hp->minor_id = ida_alloc(&ms_haptics_ida, GFP_KERNEL);
+	if (hp->minor_id < 0) {
+		ret = hp->minor_id;
+		goto err_free;
+	}
+
+	hp->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!hp->page) {
+		ret = -ENOMEM;
+		goto err_ida;
+	}
+	hp->ring = page_address(hp->page);
+	hp->ring->version = MS_HAPTICS_VERSION;
+
+	snprintf(hp->name, sizeof(hp->name), "ms-haptics%d", hp->minor_id);
+	hp->misc.minor = MISC_DYNAMIC_MINOR;
+	hp->misc.name = hp->name;
+	hp->misc.fops = &ms_haptics_fops;
+	hp->misc.parent = &ms->hdev->dev;
+	hp->misc.mode = 0600;
+
+	ret = misc_register(&hp->misc);
+	if (ret)
+		goto err_page;
+
+	return hp;
+
+err_page:
+	__free_page(hp->page);
+err_ida:
+	ida_free(&ms_haptics_ida, hp->minor_id);
+err_free:
+	kfree(hp);
+	return ERR_PTR(ret);
+}
+
+/* open files keep hp, but no longer reach the device */
+static void ms_haptics_destroy(struct ms_haptics *hp)
+{
+	if (!hp)
+		return;
+
+	misc_deregister(&hp->misc);
+
+	spin_lock_bh(&hp->lock);
+	hp->ms = NULL;
+	spin_unlock_bh(&hp->lock);
+
+	kref_put(&hp->kref, ms_haptics_free);
+}
+
+static const unsigned int ms_xbox_one_s_axes[MS_GAMEPAD_AXES] = {
+	ABS_X, ABS_Y, ABS_Z, ABS_RZ, ABS_BRAKE, ABS_GAS,
+};
+
+/* same as ms_xbox_series_x_quirk() */
+static const unsigned int ms_xbox_series_xs_axes[MS_GAMEPAD_AXES] = {
+	ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ,
+};
+
+/*
+ * buttons in report order, as hid-input maps them for a gamepad, then
+ * Share and the paddles like hid-microsoft-xbox maps them
+ */
+static const unsigned int ms_xbox_buttons[MS_GAMEPAD_BUTTONS] = {
+	BTN_A, BTN_B, BTN_C, BTN_X, BTN_Y, BTN_Z, BTN_TL, BTN_TR,
+	BTN_TL2, BTN_TR2, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL,
+	BTN_THUMBR, KEY_RECORD, BTN_TRIGGER_HAPPY5, BTN_TRIGGER_HAPPY6,
+	BTN_TRIGGER_HAPPY7, BTN_TRIGGER_HAPPY8,
+};
+
+static const struct {
+	s8 x;
+	s8 y;
+} ms_xbox_hat[XBOX_HAT_MAX + 1] = {
+	{ 0, 0 }, { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 },
+	{ 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 },
+};
+
+static const struct ms_gamepad_state ms_gamepad_neutral = {
+	.axes = { U16_MAX / 2 + 1, U16_MAX / 2 + 1, U16_MAX / 2 + 1,
+		  U16_MAX / 2 + 1, 0, 0 },
+};
+
+/* remap profile names, in report order */
+static const char * const ms_xbox_button_names[MS_GAMEPAD_BUTTONS] = {
+	"a", "b", "c", "x", "y", "z", "lb", "rb", "tl2", "tr2",
+	"view", "menu", "guide", "ls", "rs", "share", "p1", "p2", "p3", "p4",
+};
+
+static const char * const ms_xbox_axis_names[MS_GAMEPAD_AXES] = {
+	"lx", "ly", "rx", "ry", "lt", "rt",
+};
+
+static LIST_HEAD(ms_gamepads_parked);
+static DEFINE_MUTEX(ms_gamepads_lock);
+
+static unsigned int ms_gamepad_axis_max(unsigned int axis)
+{
+	return axis < 4 ? U16_MAX : XBOX_TRIGGER_MAX;
+}
+
+static void ms_gamepad_decode(const struct ms_gamepad *gp, const u8 *data,
+		unsigned int size, struct ms_gamepad_state *state)
+{
+	const struct xbox_input_report *r = (const void *)data;
+
+	state->axes[0] = le16_to_cpu(r->x);
+	state->axes[1] = le16_to_cpu(r->y);
+	state->axes[2] = le16_to_cpu(r->z);
+	state->axes[3] = le16_to_cpu(r->rz);
+	state->axes[4] = le16_to_cpu(r->brake) & XBOX_TRIGGER_MAX;
+	state->axes[5] = le16_to_cpu(r->accelerator) & XBOX_TRIGGER_MAX;
+	state->hat = r->hat & 0x0f;
+	if (state->hat > XBOX_HAT_MAX)
+		state->hat = 0;
+	state->buttons = le16_to_cpu(r->buttons) & GENMASK(XBOX_BUTTONS - 1, 0);
+	state->profile = 0;
+
+	/*
+	 * The firmware descriptor matched the known layout, usages
+	 * included, so these bits are Share or the paddles and profile.
+	 */
+	if ((gp->features & XBOX_FEATURE_SHARE) && size > XBOX_SHARE_OFFSET &&
+	    (data[XBOX_SHARE_OFFSET] & BIT(0)))
+		state->buttons |= BIT(MS_GAMEPAD_SHARE);
+
+	if ((gp->features & XBOX_FEATURE_PADDLES) && size > XBOX_PROFILE_OFFSET) {
+		state->buttons |= (data[XBOX_PADDLES_OFFSET] &
+				   GENMASK(XBOX_PADDLES - 1, 0)) << MS_GAMEPAD_PADDLE1;
+		state->profile = data[XBOX_PROFILE_OFFSET] & XBOX_PROFILE_MAX;
+	}
+}
+
+/* masked outputs rest in their neutral position */
+static void ms_remap_apply(const struct ms_remap *r,
+		const struct ms_gamepad_state *in, struct ms_gamepad_state *out)
+{
+	unsigned long buttons = in->buttons;
+	unsigned int i, max;
+	u32 value;
+
+	*out = ms_gamepad_neutral;
+
+	for (i = 0; i < MS_GAMEPAD_AXES; i++) {
+		if (r->axis[i].target == MS_REMAP_NONE)
+			continue;
+
+		max = ms_gamepad_axis_max(r->axis[i].target);
+		value = in->axes[i];
+		if (max != ms_gamepad_axis_max(i))
+			value = value * max / ms_gamepad_axis_max(i);
+		if (r->axis[i].invert)
+			value = max - value;
+		out->axes[r->axis[i].target] = value;
+	}
+
+	if (!r->hat_masked)
+		out->hat = in->hat;
+	out->profile = in->profile;
+
+	for_each_set_bit(i, &buttons, MS_GAMEPAD_BUTTONS) {
+		if (r->button[i] != MS_REMAP_NONE)
+			out->buttons |= BIT(r->button[i]);
+	}
+}
+
+/*
+ * Report what changed since the last report, or everything when @force is
+ * set, without syncing.
+ */
+static void ms_gamepad_emit(struct ms_gamepad *gp,
+		const struct ms_gamepad_state *state, bool force)
+{
+	struct input_dev *input = gp->input;
+	const struct ms_gamepad_state *old = &gp->state;
+	struct ms_gamepad_state remapped;
+	const struct ms_remap *remap;
+	unsigned long changed, sys;
+	unsigned int i;
+
+	rcu_read_lock();
+	remap = rcu_dereference(gp->remap);
+	if (remap) {
+		ms_remap_apply(remap, state, &remapped);
+		state = &remapped;
+	}
+	rcu_read_unlock();
+
+	for (i = 0; i < MS_GAMEPAD_AXES; i++) {
+		if (force || state->axes[i] != old->axes[i]) {
+			input_report_abs(input, gp->axes[i], state->axes[i]);
+			gp->events++;
+		}
+	}
+
+	if (force || state->hat != old->hat) {
+		input_report_abs(input, ABS_HAT0X, ms_xbox_hat[state->hat].x);
+		input_report_abs(input, ABS_HAT0Y, ms_xbox_hat[state->hat].y);
+		gp->events += 2;
+	}
+
+	if ((gp->features & XBOX_FEATURE_PADDLES) &&
+	    (force || state->profile != old->profile)) {
+		input_report_abs(input, ABS_PROFILE, state->profile);
+		gp->events++;
+	}
+
+	changed = (force ? ~0 : state->buttons ^ old->buttons) & gp->buttons;
+	sys = changed & gp->sys_buttons;
+	changed &= ~gp->sys_buttons;
+	for_each_set_bit(i, &changed, MS_GAMEPAD_BUTTONS)
+		input_report_key(input, ms_xbox_buttons[i],
+				 state->buttons & BIT(i));
+	gp->events += hweight_long(changed);
+
+	/* gone once ms_gamepad_destroy() cleared it */
+	if (!gp->sys_input)
+		sys = 0;
+	for_each_set_bit(i, &sys, MS_GAMEPAD_BUTTONS)
+		input_report_key(gp->sys_input, ms_xbox_buttons[i],
+				 state->buttons & BIT(i));
+	if (sys)
+		gp->sys_dirty = true;
+
+	gp->state = *state;
+}
+
+static void ms_gamepad_report(struct ms_gamepad *gp,
+		const struct ms_gamepad_state *state, bool force)
+{
+	ms_gamepad_emit(gp, state, force);
+	input_sync(gp->input);
+
+	/* listeners of the system buttons only wake up for them */
+	if (gp->sys_dirty) {
+		input_sync(gp->sys_input);
+		gp->sys_dirty = false;
+	}
+
+	xbox_burst_account(&gp->burst, gp->events + 1);
+	gp->events = 0;
+}
+
+/*
+ * Emit the state merged during the last period, called with gp->lock held.
+ * Every button change in the period gets a frame of its own, so a button
+ * pressed and released again in between is not lost.
+ */
+static bool ms_gamepad_frame_flush(struct ms_gamepad *gp)
+{
+	unsigned int i;
+
+	if (!gp->frame.dirty)
+		return false;
+
+	for (i = 0; i < gp->frame.nlog; i++)
+		ms_gamepad_report(gp, &gp->frame.log[i], false);
+	ms_gamepad_report(gp, &gp->frame.pending, false);
+	gp->frame.nlog = 0;
+	gp->frame.dirty = false;
+
+	return true;
+}
+
+/*
+ * Runs until a period passes without reports or merging is turned off.
+ * Only the timer clears frame.armed, and ms_gamepad_frame_merge() only
+ * starts it while clear, both under gp->lock. So it is never started
+ * while this forwards it, and a merge after it decided to stop starts
+ * it again, even with the callback still on its way out.
+ */
+static enum hrtimer_restart ms_gamepad_frame_timer(struct hrtimer *timer)
+{
+	struct ms_gamepad *gp = container_of(timer, struct ms_gamepad,
+					     frame.timer);
+	unsigned long flags;
+	bool flushed;
+
+	spin_lock_irqsave(&gp->lock, flags);
+	flushed = gp->frame.rate && ms_gamepad_frame_flush(gp);
+	if (flushed)
+		hrtimer_forward_now(timer, gp->frame.period);
+	else
+		gp->frame.armed = false;
+	spin_unlock_irqrestore(&gp->lock, flags);
+
+	return flushed ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/* called with gp->lock held */
+static void ms_gamepad_frame_merge(struct ms_gamepad *gp,
+		const struct ms_gamepad_state *state)
+{
+	u32 period, rem;
+	u64 now;
+
+	if (gp->frame.dirty && state->buttons != gp->frame.pending.buttons) {
+		/* more changes than fit in a period, don't hold them back */
+		if (gp->frame.nlog == MS_FRAME_LOG)
+			ms_gamepad_frame_flush(gp);
+		else
+			gp->frame.log[gp->frame.nlog++] = gp->frame.pending;
+	}
+	gp->frame.pending = *state;
+	gp->frame.dirty = true;
+
+	/* start on the next multiple of the period */
+	if (!gp->frame.armed) {
+		gp->frame.armed = true;
+		now = ktime_get_ns();
+		period = ktime_to_ns(gp->frame.period);
+		div_u64_rem(now, period, &rem);
+		hrtimer_start(&gp->frame.timer,
+			      ns_to_ktime(now - rem + period),
+			      HRTIMER_MODE_ABS_SOFT);
+	}
+}
+
+static void ms_state_page_update(struct ms_state_page *sp,
+		const struct ms_gamepad_state *state, bool connected)
+{
+	struct ms_gamepad_state_page *p = sp->data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sp->lock, flags);
+	WRITE_ONCE(p->seq, p->seq + 1);
+	smp_wmb();
+
+	p->timestamp_ns = ktime_get_ns();
+	if (connected)
+		p->report_seq = ++sp->report_seq;
+	memcpy(p->axes, state->axes, sizeof(p->axes));
+	p->buttons = lower_16_bits(state->buttons);
+	p->hat = state->hat;
+	p->connected = connected;
+	p->paddles = state->buttons >> MS_GAMEPAD_PADDLE1;
+	p->profile = state->profile;
+
+	smp_wmb();
+	WRITE_ONCE(p->seq, p->seq + 1);
+	spin_unlock_irqrestore(&sp->lock, flags);
+}
+
+static void ms_battery_update(struct ms_data *ms, __u8 value)
+{
+	int capacity = value * 100 / U8_MAX;
+
+	if (!ms->battery || capacity == ms->battery_capacity)
+		return;
+
+	ms->battery_capacity = capacity;
+	power_supply_changed(ms->battery);
+}
+
+/*
+ * Called with gp->mutex held whenever a consumer comes or goes. The last
+ * report stored while idle brings the input device up to date.
+ */
+static void ms_gamepad_update_active(struct ms_gamepad *gp)
+{
+	bool active = gp->opened ||
+		(gp->state_page && READ_ONCE(gp->state_page->users));
+	struct ms_gamepad_state state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gp->lock, flags);
+	if (active && !gp->active && gp->idle_size) {
+		ms_gamepad_decode(gp, gp->idle_report, gp->idle_size,
+				  &gp->decoded);
+		state = gp->decoded;
+		if (gp->home)
+			state.buttons |= BIT(MS_GAMEPAD_GUIDE);
+		ms_gamepad_report(gp, &state, true);
+	}
+	gp->idle_size = 0;
+	gp->active = active;
+	spin_unlock_irqrestore(&gp->lock, flags);
+}
+
+/*
+ * Guide is pressed while either button 13 of the input report or, in
+ * Windows mode, AC Home of the consumer report is. Called with gp->lock
+ * held.
+ */
+static void ms_gamepad_input(struct ms_gamepad *gp,
+		struct ms_gamepad_state *state)
+{
+	if (gp->home)
+		state->buttons |= BIT(MS_GAMEPAD_GUIDE);
+
+	if (gp->state_page)
+		ms_state_page_update(gp->state_page, state, true);
+	if (gp->frame.rate)
+		ms_gamepad_frame_merge(gp, state);
+	else
+		ms_gamepad_report(gp, state, false);
+}
+
+static int ms_gamepad_raw_event(struct hid_device *hdev, struct ms_data *ms,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct ms_gamepad *gp = ms->gamepad;
+	struct ms_gamepad_state state;
+	unsigned long flags;
+
+	switch (report->id) {
+	case XBOX_INPUT_REPORT:
+		if (size < sizeof(struct xbox_input_report))
+			break;
+		spin_lock_irqsave(&gp->lock, flags);
+		if (gp->active) {
+			ms_gamepad_decode(gp, data, size, &gp->decoded);
+			state = gp->decoded;
+			ms_gamepad_input(gp, &state);
+		} else {
+			/* only keep it, see ms_gamepad_update_active() */
+			gp->idle_size = min_t(unsigned int, size,
+					      sizeof(gp->idle_report));
+			memcpy(gp->idle_report, data, gp->idle_size);
+		}
+		spin_unlock_irqrestore(&gp->lock, flags);
+		break;
+	case XBOX_HOME_REPORT:
+		if (size < 2)
+			break;
+		spin_lock_irqsave(&gp->lock, flags);
+		gp->home = data[1] & BIT(0);
+		/* an idle pad picks it up with the stored input report */
+		if (gp->active) {
+			state = gp->decoded;
+			ms_gamepad_input(gp, &state);
+		}
+		spin_unlock_irqrestore(&gp->lock, flags);
+		break;
+	case XBOX_BATTERY_REPORT:
+		if (size < 2)
+			break;
+		ms_battery_update(ms, data[1]);
+		break;
+	}
+
+	return 0;
+}
+
+static const enum power_supply_property ms_battery_props[] = {
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_SCOPE,
+	POWER_SUPPLY_PROP_STATUS,
+};
+
+static int ms_battery_get_property(struct power_supply *psy,
+		enum power_supply_property psp, union power_supply_propval *val)
+{
+	struct ms_data *ms = power_supply_get_drvdata(psy);
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = 1;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		if (ms->battery_capacity < 0)
+			return -ENODATA;
+		val->intval = ms->battery_capacity;
+		break;
+	case POWER_SUPPLY_PROP_SCOPE:
+		val->intval = POWER_SUPPLY_SCOPE_DEVICE;
+		break;
+	case POWER_SUPPLY_PROP_STATUS:
+		val->intval = ms->battery_capacity < 0 ?
+			POWER_SUPPLY_STATUS_UNKNOWN :
+			POWER_SUPPLY_STATUS_DISCHARGING;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* hid-input isn't connected for these controllers, so do its battery */
+static int ms_battery_probe(struct hid_device *hdev)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	struct power_supply_config cfg = { .drv_data = ms };
+
+	ms->battery_capacity = -1;
+	ms->battery_desc.name = devm_kasprintf(&hdev->dev, GFP_KERNEL,
+			"hid-%s-battery",
+			strlen(hdev->uniq) ? hdev->uniq : dev_name(&hdev->dev));
+	if (!ms->battery_desc.name)
+		return -ENOMEM;
+
+	ms->battery_desc.type = POWER_SUPPLY_TYPE_BATTERY;
+	ms->battery_desc.properties = ms_battery_props;
+	ms->battery_desc.num_properties = ARRAY_SIZE(ms_battery_props);
+	ms->battery_desc.get_property = ms_battery_get_property;
+
+	ms->battery = devm_power_supply_register(&hdev->dev, &ms->battery_desc,
+						 &cfg);
+	if (IS_ERR(ms->battery)) {
+		int ret = PTR_ERR(ms->battery);
+
+		ms->battery = NULL;
+		return ret;
+	}
+
+	power_supply_powers(ms->battery, &hdev->dev);
+	return 0;
+}
+
+static int ms_gamepad_play_effect(struct input_dev *dev, void *data,
+		struct ff_effect *effect)
+{
+	struct ms_gamepad *gp = data;
+	unsigned long flags;
+
+	if (effect->type != FF_RUMBLE)
+		return 0;
+
+	spin_lock_irqsave(&gp->ff_lock, flags);
+	gp->strong = ((u32) effect->u.rumble.strong_magnitude * 100) / U16_MAX;
+	gp->weak = ((u32) effect->u.rumble.weak_magnitude * 100) / U16_MAX;
+
+	/*
+	 * While parked, or while a haptics ring has the motors, only the
+	 * state is kept. It's sent on reconnect.
+	 */
+	if (gp->ms && !READ_ONCE(gp->ms->haptics_owned)) {
+		spin_lock(&gp->ms->ff_lock);
+		gp->ms->strong = gp->strong;
+		gp->ms->weak = gp->weak;
+		spin_unlock(&gp->ms->ff_lock);
+		ms_ff_kick(gp->ms);
+	}
+	spin_unlock_irqrestore(&gp->ff_lock, flags);
+
+	return 0;
+}
+
+/*
+ * Like ms_ff_upload(). While parked there is nothing to allocate for,
+ * ms_gamepad_attach() does it on reconnect.
+ */
+static int ms_gamepad_ff_upload(struct input_dev *dev,
+		struct ff_effect *effect, struct ff_effect *old)
+{
+	struct ms_gamepad *gp = input_get_drvdata(dev);
+	int ret = 0;
+
+	mutex_lock(&gp->mutex);
+	gp->ff_used = true;
+	if (gp->ms)
+		ret = ms_ff_prepare(gp->ms);
+	mutex_unlock(&gp->mutex);
+	if (ret)
+		return ret;
+
+	return gp->ff_upload(dev, effect, old);
+}
+
+static int ms_gamepad_open(struct input_dev *dev)
+{
+	struct ms_gamepad *gp = input_get_drvdata(dev);
+	int ret = 0;
+
+	mutex_lock(&gp->mutex);
+	if (!gp->opened && gp->ms)
+		ret = hid_hw_open(gp->ms->hdev);
+	if (!ret) {
+		gp->opened++;
+		ms_gamepad_update_active(gp);
+	}
+	mutex_unlock(&gp->mutex);
+
+	return ret;
+}
+
+static void ms_gamepad_close(struct input_dev *dev)
+{
+	struct ms_gamepad *gp = input_get_drvdata(dev);
+
+	mutex_lock(&gp->mutex);
+	if (!--gp->opened && gp->ms)
+		hid_hw_close(gp->ms->hdev);
+	ms_gamepad_update_active(gp);
+	mutex_unlock(&gp->mutex);
+}
+
+static DEFINE_IDA(ms_state_page_ida);
+
+static void ms_state_page_free(struct kref *kref)
+{
+	struct ms_state_page *sp = container_of(kref, struct ms_state_page,
+						kref);
+
+	/* existing mappings hold a reference of their own on the page */
+	__free_page(sp->page);
+	ida_free(&ms_state_page_ida, sp->minor_id);
+	kfree(sp);
+}
+
+static void ms_state_page_users(struct ms_state_page *sp, int delta)
+{
+	struct ms_gamepad *gp;
+
+	mutex_lock(&sp->users_lock);
+	WRITE_ONCE(sp->users, sp->users + delta);
+	gp = sp->gp;
+	if (gp) {
+		mutex_lock(&gp->mutex);
+		ms_gamepad_update_active(gp);
+		mutex_unlock(&gp->mutex);
+	}
+	mutex_unlock(&sp->users_lock);
+}
+
+static int ms_state_page_open(struct inode *inode, struct file *file)
+{
+	struct ms_state_page *sp = container_of(file->private_data,
+						struct ms_state_page, misc);
+
+	/* misc_open() holds misc_mtx, so sp can't be deregistered yet */
+	kref_get(&sp->kref);
+	file->private_data = sp;
+	ms_state_page_users(sp, 1);
+
+	return 0;
+}
+
+static int ms_state_page_release(struct inode *inode, struct file *file)
+{
+	struct ms_state_page *sp = file->private_data;
+
+	ms_state_page_users(sp, -1);
+	kref_put(&sp->kref, ms_state_page_free);
+	return 0;
+}
+
+/* a mapping outlives the file descriptor it was made through */
+static void ms_state_page_vm_open(struct vm_area_struct *vma)
+{
+	ms_state_page_users(vma->vm_private_data, 1);
+}
+
+static void ms_state_page_vm_close(struct vm_area_struct *vma)
+{
+	ms_state_page_users(vma->vm_private_data, -1);
+}
+
+static const struct vm_operations_struct ms_state_page_vm_ops = {
+	.open = ms_state_page_vm_open,
+	.close = ms_state_page_vm_close,
+};
+
+static int ms_state_page_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ms_state_page *sp = file->private_data;
+	int ret;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	ret = vm_insert_page(vma, vma->vm_start, sp->page);
+	if (ret)
+		return ret;
+
+	vma->vm_private_data = sp;
+	vma->vm_ops = &ms_state_page_vm_ops;
+	ms_state_page_vm_open(vma);
+
+	return 0;
+}
+
+static const struct file_operations ms_state_page_fops = {
+	.owner = THIS_MODULE,
+	.open = ms_state_page_open,
+	.release = ms_state_page_release,
+	.mmap = ms_state_page_mmap,
+	.llseek = noop_llseek,
+};
+
+static struct ms_state_page *ms_state_page_create(struct ms_gamepad *gp)
+{
+	struct ms_state_page *sp;
+	int ret;
+
+	sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+	if (!sp)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&sp->kref);
+	spin_lock_init(&sp->lock);
+	mutex_init(&sp->users_lock);
+	sp->gp = gp;
+
+	sp->minor_id = ida_alloc(&ms_state_page_ida, GFP_KERNEL);
+	if (sp->minor_id < 0) {
+		ret = sp->minor_id;
+		goto err_free;
+	}
+
+	sp->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!sp->page) {
+		ret = -ENOMEM;
+		goto err_ida;
+	}
+	sp->data = page_address(sp->page);
+	sp->data->version = MS_GAMEPAD_STATE_VERSION;
+	ms_state_page_update(sp, &ms_gamepad_neutral, false);
+
+	snprintf(sp->name, sizeof(sp->name), "ms-gamepad%d", sp->minor_id);
+	sp->misc.minor = MISC_DYNAMIC_MINOR;
+	sp->misc.name = sp->name;
+	sp->misc.fops = &ms_state_page_fops;
+	sp->misc.parent = &gp->input->dev;
+	sp->misc.mode = 0444;
+
+	ret = misc_register(&sp->misc);
+	if (ret)
+		goto err_page;
+
+	return sp;
+
+err_page:
+	__free_page(sp->page);
+err_ida:
+	ida_free(&ms_state_page_ida, sp->minor_id);
+err_free:
+	kfree(sp);
+	return ERR_PTR(ret);
+}
+
+static void ms_state_page_destroy(struct ms_state_page *sp)
+{
+	if (!sp)
+		return;
+
+	mutex_lock(&sp->users_lock);
+	sp->gp = NULL;
+	mutex_unlock(&sp->users_lock);
+
+	misc_deregister(&sp->misc);
+	kref_put(&sp->kref, ms_state_page_free);
+}
+
+/*
+ * Quadratic response outside the dead zone. The sub-pixel part of the
+ * motion is carried over in @rem, in 1/range pixel units.
+ */
+static int ms_mouse_emu_axis(u16 raw, unsigned int rate, int *rem)
+{
+	const int range = U16_MAX / 2 + 1 - MS_MOUSE_EMU_DEADZONE;
+	int d = (int)raw - (U16_MAX / 2 + 1);
+	s64 acc;
+	int move;
+
+	if (abs(d) <= MS_MOUSE_EMU_DEADZONE) {
+		*rem = 0;
+		return 0;
+	}
+
+	d = d < 0 ? d + MS_MOUSE_EMU_DEADZONE : d - MS_MOUSE_EMU_DEADZONE;
+	acc = div_s64((s64)MS_MOUSE_EMU_SPEED * d * abs(d), range * rate);
+	acc += *rem;
+
+	move = div_s64_rem(acc, range, rem);
+	return move;
+}
+
+static enum hrtimer_restart ms_mouse_emu_timer(struct hrtimer *timer)
+{
+	struct ms_mouse_emu *emu = container_of(timer, struct ms_mouse_emu,
+						timer);
+	struct ms_gamepad *gp = emu->gp;
+	unsigned long buttons = 0, changed;
+	bool sync = false;
+	int dx, dy;
+
+	dx = ms_mouse_emu_axis(READ_ONCE(gp->state.axes[2]), emu->rate,
+			       &emu->rem_x);
+	dy = ms_mouse_emu_axis(READ_ONCE(gp->state.axes[3]), emu->rate,
+			       &emu->rem_y);
+
+	/* half way down counts as a click */
+	if (READ_ONCE(gp->state.axes[5]) > XBOX_TRIGGER_MAX / 2)
+		buttons |= BIT(0);
+	if (READ_ONCE(gp->state.axes[4]) > XBOX_TRIGGER_MAX / 2)
+		buttons |= BIT(1);
+
+	if (dx) {
+		input_report_rel(emu->input, REL_X, dx);
+		sync = true;
+	}
+	if (dy) {
+		input_report_rel(emu->input, REL_Y, dy);
+		sync = true;
+	}
+
+	changed = buttons ^ emu->buttons;
+	if (changed & BIT(0))
+		input_report_key(emu->input, BTN_LEFT, buttons & BIT(0));
+	if (changed & BIT(1))
+		input_report_key(emu->input, BTN_RIGHT, buttons & BIT(1));
+	emu->buttons = buttons;
+
+	if (sync || changed)
+		input_sync(emu->input);
+
+	hrtimer_forward_now(timer, emu->period);
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Called with gp->mutex held. The timer only runs while someone has the
+ * mouse open and the pad is attached, a parked pad has nothing to report.
+ */
+static void ms_mouse_emu_run(struct ms_mouse_emu *emu)
+{
+	struct ms_gamepad *gp = emu->gp;
+
+	if (emu->opened && gp->ms && !READ_ONCE(gp->ms->suspended) &&
+	    gp->mouse_emu == emu && emu->rate) {
+		if (!hrtimer_active(&emu->timer))
+			hrtimer_start(&emu->timer, emu->period,
+				      HRTIMER_MODE_REL_SOFT);
+	} else {
+		hrtimer_cancel(&emu->timer);
+	}
+}
+
+/* the mouse counts as an open of the gamepad, it needs the reports too */
+static int ms_mouse_emu_open(struct input_dev *dev)
+{
+	struct ms_mouse_emu *emu = input_get_drvdata(dev);
+	struct ms_gamepad *gp = emu->gp;
+	int ret = 0;
+
+	mutex_lock(&gp->mutex);
+	if (!gp->opened && gp->ms)
+		ret = hid_hw_open(gp->ms->hdev);
+	if (!ret) {
+		gp->opened++;
+		emu->opened = true;
+		ms_gamepad_update_active(gp);
+		ms_mouse_emu_run(emu);
+	}
+	mutex_unlock(&gp->mutex);
+
+	return ret;
+}
+
+static void ms_mouse_emu_close(struct input_dev *dev)
+{
+	struct ms_mouse_emu *emu = input_get_drvdata(dev);
+	struct ms_gamepad *gp = emu->gp;
+
+	mutex_lock(&gp->mutex);
+	emu->opened = false;
+	ms_mouse_emu_run(emu);
+	if (!--gp->opened && gp->ms)
+		hid_hw_close(gp->ms->hdev);
+	ms_gamepad_update_active(gp);
+	mutex_unlock(&gp->mutex);
+}
+
+/* registers the input device, so must not be called with gp->mutex held */
+static struct ms_mouse_emu *ms_mouse_emu_create(struct ms_gamepad *gp)
+{
+	struct ms_mouse_emu *emu;
+	struct input_dev *input;
+	int ret;
+
+	emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return ERR_PTR(-ENOMEM);
+
+	input = input_allocate_device();
+	if (!input) {
+		kfree(emu);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	snprintf(emu->name, sizeof(emu->name), "%s Mouse", gp->name);
+	input->name = emu->name;
+	input->phys = gp->phys;
+	input->uniq = gp->uniq;
+	input->id = gp->input->id;
+	input->dev.parent = &gp->input->dev;
+	input_set_capability(input, EV_REL, REL_X);
+	input_set_capability(input, EV_REL, REL_Y);
+	input_set_capability(input, EV_KEY, BTN_LEFT);
+	input_set_capability(input, EV_KEY, BTN_RIGHT);
+	input->open = ms_mouse_emu_open;
+	input->close = ms_mouse_emu_close;
+	input_set_drvdata(input, emu);
+
+	emu->input = input;
+	emu->gp = gp;
+	hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	emu->timer.function = ms_mouse_emu_timer;
+
+	/* mousedev may open it right away, taking gp->mutex */
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		kfree(emu);
+		return ERR_PTR(ret);
+	}
+
+	return emu;
+}
+
+static void ms_mouse_emu_destroy(struct ms_mouse_emu *emu)
+{
+	if (!emu)
+		return;
+
+	hrtimer_cancel(&emu->timer);
+	input_unregister_device(emu->input);
+	kfree(emu);
+}
+
+/* shares open/close with the gamepad, either one makes it active */
+static int ms_gamepad_sys_create(struct ms_gamepad *gp)
+{
+	struct input_dev *input;
+	unsigned long buttons = gp->sys_buttons;
+	unsigned int i;
+	int ret;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
+
+	snprintf(gp->sys_name, sizeof(gp->sys_name), "%s System Buttons",
+		 gp->name);
+	input->name = gp->sys_name;
+	input->phys = gp->phys;
+	input->uniq = gp->uniq;
+	input->id = gp->input->id;
+	input->dev.parent = &gp->input->dev;
+	input->open = ms_gamepad_open;
+	input->close = ms_gamepad_close;
+	input_set_drvdata(input, gp);
+
+	for_each_set_bit(i, &buttons, MS_GAMEPAD_BUTTONS)
+		input_set_capability(input, EV_KEY, ms_xbox_buttons[i]);
+
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		return ret;
+	}
+
+	gp->sys_input = input;
+	return 0;
+}
+
+static void ms_gamepad_destroy(struct ms_gamepad *gp)
+{
+	struct input_dev *sys_input;
+	struct ms_remap *remap;
+	unsigned long flags;
+
+	ms_mouse_emu_destroy(gp->mouse_emu);
+	ms_state_page_destroy(gp->state_page);
+
+	/* everything reporting to it holds gp->lock */
+	spin_lock_irqsave(&gp->lock, flags);
+	sys_input = gp->sys_input;
+	gp->sys_input = NULL;
+	gp->sys_dirty = false;
+	spin_unlock_irqrestore(&gp->lock, flags);
+	if (sys_input)
+		input_unregister_device(sys_input);
+	input_unregister_device(gp->input);
+
+	/* ms_gamepad_emit() may still be looking at the table */
+	remap = rcu_access_pointer(gp->remap);
+	if (remap)
+		kfree_rcu(remap, rcu);
+	kfree(gp);
+}
+
+static void ms_gamepad_expire(struct work_struct *work)
+{
+	struct ms_gamepad *gp = container_of(to_delayed_work(work),
+					     struct ms_gamepad, expire);
+
+	mutex_lock(&ms_gamepads_lock);
+	/* picked up by a reconnect in the meantime */
+	if (list_empty(&gp->list)) {
+		mutex_unlock(&ms_gamepads_lock);
+		return;
+	}
+	list_del_init(&gp->list);
+	mutex_unlock(&ms_gamepads_lock);
+
+	ms_gamepad_destroy(gp);
+}
+
+static struct ms_gamepad *ms_gamepad_create(struct hid_device *hdev)
+{
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	struct input_dev *input;
+	struct ms_gamepad *gp;
+	unsigned int i;
+	int ret;
+
+	gp = kzalloc(sizeof(*gp), GFP_KERNEL);
+	if (!gp)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&gp->list);
+	INIT_DELAYED_WORK(&gp->expire, ms_gamepad_expire);
+	mutex_init(&gp->mutex);
+	spin_lock_init(&gp->lock);
+	spin_lock_init(&gp->ff_lock);
+	hrtimer_init(&gp->frame.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	gp->frame.timer.function = ms_gamepad_frame_timer;
+	strscpy(gp->name, hdev->name, sizeof(gp->name));
+	strscpy(gp->phys, hdev->phys, sizeof(gp->phys));
+	strscpy(gp->uniq, hdev->uniq, sizeof(gp->uniq));
+	gp->product = hdev->product;
+	gp->axes = (ms->quirks & MS_XBOX_SERIES_X) ? ms_xbox_series_xs_axes :
+		ms_xbox_one_s_axes;
+	gp->features = ms->xbox_rdesc->features;
+	gp->decoded = ms_gamepad_neutral;
+
+	input = input_allocate_device();
+	if (!input) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	/* the strings must outlive the HID device */
+	input->name = gp->name;
+	input->phys = gp->phys;
+	input->uniq = gp->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->dev.parent = &hdev->dev;
+	input->open = ms_gamepad_open;
+	input->close = ms_gamepad_close;
+	input_set_drvdata(input, gp);
+	gp->input = input;
+
+	/* same ranges and fuzz as hid-input gives these axes */
+	for (i = 0; i < MS_GAMEPAD_AXES; i++) {
+		int max = ms_gamepad_axis_max(i);
+
+		input_set_abs_params(input, gp->axes[i], 0, max, max >> 8,
+				     max >> 4);
+	}
+	input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+	input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+
+	gp->buttons = GENMASK(XBOX_BUTTONS - 1, 0);
+	if (gp->features & XBOX_FEATURE_SHARE)
+		gp->buttons |= BIT(MS_GAMEPAD_SHARE);
+	if (gp->features & XBOX_FEATURE_PADDLES) {
+		gp->buttons |= GENMASK(MS_GAMEPAD_PADDLE1 + XBOX_PADDLES - 1,
+				       MS_GAMEPAD_PADDLE1);
+		input_set_abs_params(input, ABS_PROFILE, 0, XBOX_PROFILE_MAX,
+				     0, 0);
+	}
+	if (READ_ONCE(system_buttons))
+		gp->sys_buttons = gp->buttons &
+			(BIT(MS_GAMEPAD_GUIDE) | BIT(MS_GAMEPAD_SHARE));
+	for (i = 0; i < MS_GAMEPAD_BUTTONS; i++)
+		if ((gp->buttons & ~gp->sys_buttons) & BIT(i))
+			input_set_capability(input, EV_KEY, ms_xbox_buttons[i]);
+
+	/* size the evdev buffers for a full report, not hid-input's guess */
+	input_set_events_per_packet(input, MS_GAMEPAD_EVENTS);
+	xbox_burst_init(&gp->burst, MS_GAMEPAD_EVENTS);
+
+	input_set_capability(input, EV_FF, FF_RUMBLE);
+	ret = input_ff_create_memless(input, gp, ms_gamepad_play_effect);
+	if (ret)
+		goto err_free_input;
+	gp->ff_upload = input->ff->upload;
+	input->ff->upload = ms_gamepad_ff_upload;
+
+	ret = input_register_device(input);
+	if (ret)
+		goto err_free_input;
+
+	if (gp->sys_buttons) {
+		ret = ms_gamepad_sys_create(gp);
+		if (ret) {
+			input_unregister_device(input);
+			goto err_free;
+		}
+	}
+
+	if (READ_ONCE(state_page)) {
+		gp->state_page = ms_state_page_create(gp);
+		if (IS_ERR(gp->state_page)) {
+			hid_warn(hdev, "could not create state page: %ld\n",
+				 PTR_ERR(gp->state_page));
+			gp->state_page = NULL;
+		}
+
+		/* it may have been opened before gp->state_page was set */
+		mutex_lock(&gp->mutex);
+		ms_gamepad_update_active(gp);
+		mutex_unlock(&gp->mutex);
+	}
+
+	return gp;
+
+err_free_input:
+	input_free_device(input);
+err_free:
+	kfree(gp);
+	return ERR_PTR(ret);
+}
+
+static struct ms_gamepad *ms_gamepad_unpark(struct hid_device *hdev)
+{
+	struct ms_gamepad *gp, *found = NULL;
+
+	if (!strlen(hdev->uniq))
+		return NULL;
+
+	mutex_lock(&ms_gamepads_lock);
+	list_for_each_entry(gp, &ms_gamepads_parked, list) {
+		if (gp->product == hdev->product &&
+				!strcmp(gp->uniq, hdev->uniq)) {
+			list_del_init(&gp->list);
+			found = gp;
+			break;
+		}
+	}
+	mutex_unlock(&ms_gamepads_lock);
+
+	if (found)
+		cancel_delayed_work_sync(&found->expire);
+
+	return found;
+}
+
+static void ms_gamepad_attach(struct ms_gamepad *gp, struct ms_data *ms)
+{
+	struct hid_device *hdev = ms->hdev;
+	unsigned long flags;
+	bool rumble;
+
+	mutex_lock(&gp->mutex);
+	if (gp->opened && hid_hw_open(hdev))
+		hid_warn(hdev, "could not reopen the device\n");
+
+	/*
+	 * Effects uploaded before, or while parked, play on this link. The
+	 * worker drops them if that fails, the next upload tries again.
+	 */
+	if (gp->ff_used && ms_ff_prepare(ms))
+		hid_warn(hdev, "could not restore rumble\n");
+
+	spin_lock_irqsave(&gp->ff_lock, flags);
+	gp->ms = ms;
+	spin_lock(&ms->ff_lock);
+	ms->strong = gp->strong;
+	ms->weak = gp->weak;
+	spin_unlock(&ms->ff_lock);
+	rumble = gp->strong || gp->weak;
+	spin_unlock_irqrestore(&gp->ff_lock, flags);
+	if (gp->mouse_emu)
+		ms_mouse_emu_run(gp->mouse_emu);
+	mutex_unlock(&gp->mutex);
+
+	ms->gamepad = gp;
+
+	/* restore the rumble that was playing when the link dropped */
+	if (rumble)
+		ms_ff_kick(ms);
+}
+
+/* the gamepad stops using the HID device, called before it's stopped */
+static void ms_gamepad_detach(struct ms_gamepad *gp, struct ms_data *ms)
+{
+	unsigned long flags;
+
+	mutex_lock(&gp->mutex);
+	if (gp->opened)
+		hid_hw_close(ms->hdev);
+
+	spin_lock_irqsave(&gp->ff_lock, flags);
+	gp->ms = NULL;
+	spin_unlock_irqrestore(&gp->ff_lock, flags);
+	if (gp->mouse_emu)
+		ms_mouse_emu_run(gp->mouse_emu);
+	mutex_unlock(&gp->mutex);
+}
+
+static int ms_remap_lookup(const char * const *names, unsigned int n,
+		const char *name)
+{
+	int i = match_string(names, n, name);
+
+	if (i < 0 && !strcmp(name, "none"))
+		return MS_REMAP_NONE;
+
+	return i;
+}
+
+/*
+ * Compile "<input>=<output> ..." into a lookup table. Inputs that are not
+ * listed keep their place, "none" masks an input and "-" in front of an
+ * output axis inverts it. Axes are rescaled to the range of their output.
+ */
+static struct ms_remap *ms_remap_compile(char *buf)
+{
+	struct ms_remap *r;
+	char *tok, *out;
+	bool identity = true;
+	bool invert;
+	int i, j;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < MS_GAMEPAD_BUTTONS; i++)
+		r->button[i] = i;
+	for (i = 0; i < MS_GAMEPAD_AXES; i++)
+		r->axis[i].target = i;
+
+	while ((tok = strsep(&buf, " \t\n"))) {
+		if (!*tok)
+			continue;
+
+		out = tok;
+		tok = strsep(&out, "=");
+		if (!out)
+			goto err_inval;
+
+		if (!strcmp(tok, "hat")) {
+			if (strcmp(out, "none"))
+				goto err_inval;
+			r->hat_masked = true;
+			identity = false;
+			continue;
+		}
+
+		i = match_string(ms_xbox_button_names, MS_GAMEPAD_BUTTONS, tok);
+		if (i >= 0) {
+			j = ms_remap_lookup(ms_xbox_button_names,
+					    MS_GAMEPAD_BUTTONS, out);
+			if (j < 0)
+				goto err_inval;
+			r->button[i] = j;
+			identity &= i == j;
+			continue;
+		}
+
+		i = match_string(ms_xbox_axis_names, MS_GAMEPAD_AXES, tok);
+		if (i < 0)
+			goto err_inval;
+
+		invert = *out == '-';
+		j = ms_remap_lookup(ms_xbox_axis_names, MS_GAMEPAD_AXES,
+				    out + invert);
+		if (j < 0 || (invert && j == MS_REMAP_NONE))
+			goto err_inval;
+		r->axis[i].target = j;
+		r->axis[i].invert = invert;
+		identity &= i == j && !invert;
+	}
+
+	if (identity) {
+		kfree(r);
+		return NULL;
+	}
+
+	return r;
+
+err_inval:
+	kfree(r);
+	return ERR_PTR(-EINVAL);
+}
+
+static ssize_t remap_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+	const struct ms_remap *r;
+	const char *name;
+	unsigned int i;
+	int len = 0;
+
+	rcu_read_lock();
+	r = rcu_dereference(ms->gamepad->remap);
+	if (r) {
+		for (i = 0; i < MS_GAMEPAD_BUTTONS; i++) {
+			if (r->button[i] == i)
+				continue;
+			name = r->button[i] == MS_REMAP_NONE ? "none" :
+				ms_xbox_button_names[r->button[i]];
+			len += sysfs_emit_at(buf, len, "%s=%s ",
+					     ms_xbox_button_names[i], name);
+		}
+		for (i = 0; i < MS_GAMEPAD_AXES; i++) {
+			if (r->axis[i].target == i && !r->axis[i].invert)
+				continue;
+			name = r->axis[i].target == MS_REMAP_NONE ? "none" :
+				ms_xbox_axis_names[r->axis[i].target];
+			len += sysfs_emit_at(buf, len, "%s=%s%s ",
+					     ms_xbox_axis_names[i],
+					     r->axis[i].invert ? "-" : "",
+					     name);
+		}
+		if (r->hat_masked)
+			len += sysfs_emit_at(buf, len, "hat=none ");
+	}
+	rcu_read_unlock();
+
+	/* replace the trailing space */
+	if (len)
+		len--;
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t remap_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+	struct ms_gamepad *gp = ms->gamepad;
+	struct ms_remap *r, *old;
+	char *spec;
+
+	spec = kstrndup(buf, count, GFP_KERNEL);
+	if (!spec)
+		return -ENOMEM;
+	r = ms_remap_compile(spec);
+	kfree(spec);
+	if (IS_ERR(r))
+		return PTR_ERR(r);
+
+	mutex_lock(&gp->mutex);
+	old = rcu_replace_pointer(gp->remap, r, lockdep_is_held(&gp->mutex));
+	mutex_unlock(&gp->mutex);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return count;
+}
+static DEVICE_ATTR_RW(remap);
+
+static ssize_t mouse_emulation_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned int rate;
+
+	mutex_lock(&gp->mutex);
+	rate = gp->mouse_emu ? gp->mouse_emu->rate : 0;
+	mutex_unlock(&gp->mutex);
+
+	return sysfs_emit(buf, "%u\n", rate);
+}
+
+/* serialises writers, the mouse is created and destroyed outside gp->mutex */
+static DEFINE_MUTEX(ms_mouse_emu_lock);
+
+/* polling rate in Hz, 0 turns the emulated mouse off */
+static ssize_t mouse_emulation_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+	struct ms_gamepad *gp = ms->gamepad;
+	struct ms_mouse_emu *emu;
+	unsigned int rate;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &rate);
+	if (ret)
+		return ret;
+	if (rate > MS_MOUSE_EMU_RATE_MAX)
+		return -EINVAL;
+
+	mutex_lock(&ms_mouse_emu_lock);
+	emu = gp->mouse_emu;
+	if (!rate) {
+		mutex_lock(&gp->mutex);
+		gp->mouse_emu = NULL;
+		mutex_unlock(&gp->mutex);
+		ms_mouse_emu_destroy(emu);
+		goto out;
+	}
+
+	if (!emu) {
+		emu = ms_mouse_emu_create(gp);
+		if (IS_ERR(emu)) {
+			mutex_unlock(&ms_mouse_emu_lock);
+			return PTR_ERR(emu);
+		}
+	}
+
+	mutex_lock(&gp->mutex);
+	hrtimer_cancel(&emu->timer);
+	emu->rate = rate;
+	emu->period = ns_to_ktime(NSEC_PER_SEC / rate);
+	gp->mouse_emu = emu;
+	ms_mouse_emu_run(emu);
+	mutex_unlock(&gp->mutex);
+out:
+	mutex_unlock(&ms_mouse_emu_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(mouse_emulation);
+
+static ssize_t frame_rate_hz_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ms->gamepad->frame.rate));
+}
+
+/*
+ * 0 reports every input report as it comes. Otherwise the reports of a
+ * period are merged into one frame with a single sync, except that
+ * every button change in it keeps a frame of its own so no press is
+ * lost: a period with n button changes emits n + 1 frames.
+ */
+static ssize_t frame_rate_hz_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ms_data *ms = hid_get_drvdata(to_hid_device(dev));
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned long flags;
+	unsigned int rate;
 	int ret;
 
-	memset(r, 0, sizeof(*r));
+	ret = kstrtouint(buf, 0, &rate);
+	if (ret)
+		return ret;
+	if (rate > MS_FRAME_RATE_MAX)
+		return -EINVAL;
 
-	r->report_id = XB1S_FF_REPORT;
-	r->enable = ENABLE_WEAK | ENABLE_STRONG;
 	/*
-	 * Specifying maximum duration and maximum loop count should
-	 * cover maximum duration of a single effect, which is 65536
-	 * ms
+	 * Emit whatever was merged so far. A timer still queued finds
+	 * nothing to flush and stops, or flushes at the new rate.
 	 */
-	r->duration_10ms = U8_MAX;
-	r->loop_count = U8_MAX;
-	r->magnitude[MAGNITUDE_STRONG] = ms->strong; /* left actuator */
-	r->magnitude[MAGNITUDE_WEAK] = ms->weak;     /* right actuator */
+	spin_lock_irqsave(&gp->lock, flags);
+	ms_gamepad_frame_flush(gp);
+	if (rate)
+		gp->frame.period = ns_to_ktime(NSEC_PER_SEC / rate);
+	WRITE_ONCE(gp->frame.rate, rate);
+	spin_unlock_irqrestore(&gp->lock, flags);
 
-	ret = hid_hw_output_report(hdev, (__u8 *)r, sizeof(*r));
-	if (ret < 0)
-		hid_warn(hdev, "failed to send FF report\n");
+	return count;
 }
+static DEVICE_ATTR_RW(frame_rate_hz);
 
-static int ms_play_effect(struct input_dev *dev, void *data,
-			  struct ff_effect *effect)
+static struct attribute *ms_gamepad_attrs[] = {
+	&dev_attr_remap.attr,
+	&dev_attr_mouse_emulation.attr,
+	&dev_attr_frame_rate_hz.attr,
+	NULL
+};
+
+static const struct attribute_group ms_gamepad_attr_group = {
+	.attrs = ms_gamepad_attrs,
+};
+
+static int ms_gamepad_probe(struct hid_device *hdev)
 {
-	struct hid_device *hid = input_get_drvdata(dev);
-	struct ms_data *ms = hid_get_drvdata(hid);
+	struct ms_data *ms = hid_get_drvdata(hdev);
+	struct ms_gamepad *gp;
+	int ret;
 
-	if (effect->type != FF_RUMBLE)
-		return 0;
+	ret = ms_battery_probe(hdev);
+	if (ret)
+		hid_warn(hdev, "could not register battery: %d\n", ret);
 
-	/*
-	 * Magnitude is 0..100 so scale the 16-bit input here
-	 */
-	ms->strong = ((u32) effect->u.rumble.strong_magnitude * 100) / U16_MAX;
-	ms->weak = ((u32) effect->u.rumble.weak_magnitude * 100) / U16_MAX;
+	gp = ms_gamepad_unpark(hdev);
+	if (gp) {
+		hid_info(hdev, "reusing input device of previous connection\n");
+		ret = device_move(&gp->input->dev, &hdev->dev,
+				  DPM_ORDER_DEV_AFTER_PARENT);
+		if (ret)
+			hid_warn(hdev, "could not move input device: %d\n",
+				 ret);
+	} else {
+		gp = ms_gamepad_create(hdev);
+		if (IS_ERR(gp))
+			return PTR_ERR(gp);
+	}
+
+	ms_gamepad_attach(gp, ms);
+
+	ret = sysfs_create_group(&hdev->dev.kobj, &ms_gamepad_attr_group);
+	if (ret)
+		hid_warn(hdev, "could not create sysfs group: %d\n", ret);
 
-	schedule_work(&ms->ff_worker);
 	return 0;
 }
 
-static int ms_init_ff(struct hid_device *hdev)
+/*
+ * With reconnect_grace_ms set, the input device of a controller with a
+ * Bluetooth address is kept around on the virtual bus and handed to the
+ * next connection of the same controller, along with the absinfo a
+ * calibration tool set through EVIOCSABS and the joydev correction
+ * attached to it. Called once the HID device is stopped, so no input
+ * report races with the teardown.
+ */
+static void ms_gamepad_remove(struct hid_device *hdev)
 {
-	struct hid_input *hidinput;
-	struct input_dev *input_dev;
 	struct ms_data *ms = hid_get_drvdata(hdev);
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned int grace = READ_ONCE(reconnect_grace_ms);
+	unsigned long flags;
+	int ret;
 
-	if (list_empty(&hdev->inputs)) {
-		hid_err(hdev, "no inputs found\n");
-		return -ENODEV;
+	/* a frame still pending is superseded by the neutral report */
+	hrtimer_cancel(&gp->frame.timer);
+	spin_lock_irqsave(&gp->lock, flags);
+	gp->frame.dirty = false;
+	gp->frame.nlog = 0;
+	/* the device is stopped, nothing merges and arms it again */
+	gp->frame.armed = false;
+	gp->decoded = ms_gamepad_neutral;
+	gp->home = false;
+	gp->idle_size = 0;
+	spin_unlock_irqrestore(&gp->lock, flags);
+	ms->gamepad = NULL;
+
+	if (!grace || !strlen(gp->uniq)) {
+		ms_gamepad_destroy(gp);
+		return;
 	}
-	hidinput = list_entry(hdev->inputs.next, struct hid_input, list);
-	input_dev = hidinput->input;
 
-	if (!(ms->quirks & MS_QUIRK_FF))
-		return 0;
+	/* don't leave buttons held or sticks deflected while parked */
+	spin_lock_irqsave(&gp->lock, flags);
+	ms_gamepad_report(gp, &ms_gamepad_neutral, false);
+	spin_unlock_irqrestore(&gp->lock, flags);
+	if (gp->state_page)
+		ms_state_page_update(gp->state_page, &ms_gamepad_neutral,
+				     false);
 
-	ms->hdev = hdev;
-	INIT_WORK(&ms->ff_worker, ms_ff_worker);
+	ret = device_move(&gp->input->dev, NULL, DPM_ORDER_NONE);
+	if (ret) {
+		hid_warn(hdev, "could not park input device: %d\n", ret);
+		ms_gamepad_destroy(gp);
+		return;
+	}
 
-	ms->output_report_dmabuf = devm_kzalloc(&hdev->dev,
-						sizeof(struct xb1s_ff_report),
-						GFP_KERNEL);
-	if (ms->output_report_dmabuf == NULL)
-		return -ENOMEM;
+	mutex_lock(&ms_gamepads_lock);
+	list_add_tail(&gp->list, &ms_gamepads_parked);
+	mutex_unlock(&ms_gamepads_lock);
 
-	input_set_capability(input_dev, EV_FF, FF_RUMBLE);
-	return input_ff_create_memless(input_dev, NULL, ms_play_effect);
+	schedule_delayed_work(&gp->expire, msecs_to_jiffies(grace));
 }
 
-static void ms_remove_ff(struct hid_device *hdev)
+static void ms_gamepads_exit(void)
 {
-	struct ms_data *ms = hid_get_drvdata(hdev);
+	struct ms_gamepad *gp, *tmp;
+	LIST_HEAD(parked);
 
-	if (!(ms->quirks & MS_QUIRK_FF))
-		return;
+	mutex_lock(&ms_gamepads_lock);
+	list_splice_init(&ms_gamepads_parked, &parked);
+	mutex_unlock(&ms_gamepads_lock);
 
-	cancel_work_sync(&ms->ff_worker);
+	list_for_each_entry_safe(gp, tmp, &parked, list) {
+		list_del_init(&gp->list);
+		cancel_delayed_work_sync(&gp->expire);
+		ms_gamepad_destroy(gp);
+	}
+}
+
+static unsigned int ms_connect_mask(struct hid_device *hdev, unsigned int mask)
+{
+	int i, ret;
+
+	/* connect[] can be rewritten through sysfs at any time */
+	kernel_param_lock(THIS_MODULE);
+	for (i = 0; i < connect_count; i++) {
+		ret = xbox_connect_parse(hdev, connect[i], &mask);
+		if (ret < 0)
+			hid_warn(hdev, "ignoring malformed connect entry '%s'\n",
+				 connect[i]);
+		else if (ret)
+			break;
+	}
+	kernel_param_unlock(THIS_MODULE);
+
+	return mask;
 }
 
 static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	unsigned long quirks = id->driver_data;
+	unsigned int connect_mask = HID_CONNECT_DEFAULT;
+	u64 start = ktime_get_ns(), phase;
 	struct ms_data *ms;
+	bool own_input;
 	int ret;
 
 	ms = devm_kzalloc(&hdev->dev, sizeof(*ms), GFP_KERNEL);
 	if (ms == NULL)
 		return -ENOMEM;
 
+	ms->timing.start = start;
+
 	ms->quirks = quirks;
+	ms->hdev = hdev;
 
 	hid_set_drvdata(hdev, ms);
 
@@ -413,22 +3745,102 @@ static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	if (quirks & MS_SURFACE_DIAL)
 		hdev->quirks |= HID_QUIRK_INPUT_PER_APP;
 
+	if (quirks & MS_MOUSE) {
+		ms->mouse.fast_path = mouse_fast_path;
+		spin_lock_init(&ms->mouse.lock);
+		hrtimer_init(&ms->mouse.timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS);
+		ms->mouse.timer.function = ms_mouse_timer;
+
+		/* ms_report() syncs, see ms_mouse_raw_event() */
+		if (ms->mouse.fast_path)
+			hdev->quirks |= HID_QUIRK_NO_INPUT_SYNC;
+	}
+
+	spin_lock_init(&ms->ff_lock);
+
+	if (quirks & MS_QUIRK_FF) {
+		INIT_WORK(&ms->ff_worker, ms_ff_worker);
+		spin_lock_init(&ms->ff_align.lock);
+		hrtimer_init(&ms->ff_align.timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL_SOFT);
+		ms->ff_align.timer.function = ms_ff_align_timer;
+	}
+
+	ms_rdesc_fixups_load(hdev);
+
+	phase = ktime_get_ns();
 	ret = hid_parse(hdev);
 	if (ret) {
 		hid_err(hdev, "parse failed\n");
 		goto err_free;
 	}
+	ms->timing.parse = ktime_get_ns() - phase;
 
-	ret = hid_hw_start(hdev, HID_CONNECT_DEFAULT | ((quirks & MS_HIDINPUT) ?
-				HID_CONNECT_HIDINPUT_FORCE : 0));
+	connect_mask = ms_connect_mask(hdev, connect_mask);
+
+	/*
+	 * On request the driver does the input device itself for known Xbox
+	 * layouts, so it can outlive the HID device. hid-input is the
+	 * default.
+	 */
+	own_input = ms->xbox_rdesc &&
+		(READ_ONCE(gamepad_input) || READ_ONCE(reconnect_grace_ms));
+	if (own_input)
+		connect_mask &= HID_CONNECT_HIDRAW;
+	else if ((quirks & MS_HIDINPUT) && (connect_mask & HID_CONNECT_HIDINPUT))
+		connect_mask |= HID_CONNECT_HIDINPUT_FORCE;
+
+	phase = ktime_get_ns();
+	ret = hid_hw_start(hdev, connect_mask);
 	if (ret) {
 		hid_err(hdev, "hw start failed\n");
 		goto err_free;
 	}
+	ms->timing.hw_start = ktime_get_ns() - phase;
 
-	ret = ms_init_ff(hdev);
-	if (ret)
-		hid_err(hdev, "could not initialize ff, continuing anyway");
+	if (ms->quirks & MS_MOUSE)
+		WRITE_ONCE(ms->mouse.bypass, ms_mouse_bypass(hdev, &ms->mouse));
+
+	phase = ktime_get_ns();
+	if (own_input) {
+		ret = ms_gamepad_probe(hdev);
+		if (ret) {
+			hid_err(hdev, "could not create gamepad\n");
+			hid_hw_stop(hdev);
+			goto err_free;
+		}
+	} else {
+		ret = ms_init_ff(hdev);
+		if (ret)
+			hid_err(hdev, "could not initialize ff, continuing anyway");
+	}
+	ms->timing.input = ktime_get_ns() - phase;
+
+	if (ms->quirks & MS_QUIRK_FF) {
+		mutex_lock(&ms_ff_lock);
+		list_add_tail(&ms->ff_node, &ms_ff_devices);
+		mutex_unlock(&ms_ff_lock);
+
+		if (READ_ONCE(haptics_stream)) {
+			ms->haptics = ms_haptics_create(ms);
+			if (IS_ERR(ms->haptics)) {
+				hid_warn(hdev, "could not create haptics ring: %ld\n",
+					 PTR_ERR(ms->haptics));
+				ms->haptics = NULL;
+			}
+		}
+	}
+
+	ms->pm_nb.notifier_call = ms_pm_notify;
+	ret = register_pm_notifier(&ms->pm_nb);
+	if (ret) {
+		hid_warn(hdev, "could not follow system sleep: %d\n", ret);
+		ms->pm_nb.notifier_call = NULL;
+	}
+
+	ms_debugfs_init(hdev);
+	ms->timing.total = ktime_get_ns() - start;
 
 	return 0;
 err_free:
@@ -437,10 +3849,415 @@ err_free:
 
 static void ms_remove(struct hid_device *hdev)
 {
+	struct ms_data *ms = hid_get_drvdata(hdev);
+
+	if (ms->pm_nb.notifier_call)
+		unregister_pm_notifier(&ms->pm_nb);
+	debugfs_remove_recursive(ms->debugfs);
+
+	if (ms->quirks & MS_QUIRK_FF) {
+		mutex_lock(&ms_ff_lock);
+		list_del(&ms->ff_node);
+		mutex_unlock(&ms_ff_lock);
+	}
+
+	/*
+	 * hid-core holds driver_input_lock during remove, so no report is
+	 * in flight, and with the timer fenced off nothing can arm it again
+	 * before hid_hw_stop() frees its input device.
+	 */
+	if (ms->quirks & MS_MOUSE)
+		ms_mouse_stop(&ms->mouse);
+
+	/* nothing reaches the device once it's stopped */
+	ms_haptics_destroy(ms->haptics);
+	if (ms->gamepad) {
+		sysfs_remove_group(&hdev->dev.kobj, &ms_gamepad_attr_group);
+		ms_gamepad_detach(ms->gamepad, ms);
+	}
+
 	hid_hw_stop(hdev);
 	ms_remove_ff(hdev);
+
+	if (ms->gamepad)
+		ms_gamepad_remove(hdev);
+}
+
+/*
+ * The input devices stay registered across system sleep, the link is
+ * expected to survive it. Rumble and the timers are stopped here, resume
+ * sends the last rumble state again and restarts the emulated mouse if
+ * it is in use. The frame timer stops by itself once nothing is left to
+ * flush. The other timers are armed again by the next input report.
+ */
+static void ms_suspend(struct ms_data *ms)
+{
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned long flags;
+
+	WRITE_ONCE(ms->suspended, true);
+
+	if (ms->quirks & MS_QUIRK_FF) {
+		hrtimer_cancel(&ms->ff_align.timer);
+		spin_lock_irqsave(&ms->ff_align.lock, flags);
+		ms->ff_align.waiting = false;
+		spin_unlock_irqrestore(&ms->ff_align.lock, flags);
+		cancel_work_sync(&ms->ff_worker);
+	}
+
+	if ((ms->quirks & MS_MOUSE) && ms->mouse.input) {
+		hrtimer_cancel(&ms->mouse.timer);
+		spin_lock_irqsave(&ms->mouse.lock, flags);
+		ms_mouse_flush(&ms->mouse);
+		spin_unlock_irqrestore(&ms->mouse.lock, flags);
+	}
+
+	if (!gp)
+		return;
+
+	/* the frame timer finds nothing left to flush and stops */
+	spin_lock_irqsave(&gp->lock, flags);
+	ms_gamepad_frame_flush(gp);
+	spin_unlock_irqrestore(&gp->lock, flags);
+
+	/* stopped by ms->suspended */
+	mutex_lock(&gp->mutex);
+	if (gp->mouse_emu)
+		ms_mouse_emu_run(gp->mouse_emu);
+	mutex_unlock(&gp->mutex);
+
+	/* the controller moves on while we sleep, don't replay old state */
+	spin_lock_irqsave(&gp->lock, flags);
+	gp->idle_size = 0;
+	spin_unlock_irqrestore(&gp->lock, flags);
+}
+
+/* rumble is all the state the device keeps, even across a reset */
+static void ms_resume(struct ms_data *ms)
+{
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned long flags;
+	bool rumble;
+
+	ms->timing.resumes++;
+	WRITE_ONCE(ms->timing.resume_start, ktime_get_ns());
+	WRITE_ONCE(ms->suspended, false);
+
+	if (gp) {
+		mutex_lock(&gp->mutex);
+		if (gp->mouse_emu)
+			ms_mouse_emu_run(gp->mouse_emu);
+		mutex_unlock(&gp->mutex);
+	}
+
+	if (!(ms->quirks & MS_QUIRK_FF))
+		return;
+
+	spin_lock_irqsave(&ms->ff_lock, flags);
+	rumble = ms->strong || ms->weak;
+	spin_unlock_irqrestore(&ms->ff_lock, flags);
+	if (rumble)
+		ms_ff_kick(ms);
+}
+
+/*
+ * hidp and uhid, which carry the Bluetooth controllers, never call the
+ * suspend and resume callbacks of a HID driver, so follow system sleep
+ * itself.
+ */
+static int ms_pm_notify(struct notifier_block *nb, unsigned long action,
+		void *data)
+{
+	struct ms_data *ms = container_of(nb, struct ms_data, pm_nb);
+
+	switch (action) {
+	case PM_HIBERNATION_PREPARE:
+	case PM_SUSPEND_PREPARE:
+		ms_suspend(ms);
+		break;
+	case PM_POST_HIBERNATION:
+	case PM_POST_SUSPEND:
+		ms_resume(ms);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+#if IS_REACHABLE(CONFIG_CONFIGFS_FS)
+
+/*
+ * Rumble groups: mkdir /sys/kernel/config/hid-microsoft/<group>, write
+ * the HID device names to members and "<strong> <weak> [<ms>]" (percent)
+ * to trigger. All members get their output report from the same context,
+ * back to back, instead of from one work item each. They go out at once,
+ * ff_align_us doesn't hold them for an input report and the ff_align
+ * statistics don't count them.
+ */
+
+#define MS_FF_GROUP_MAX		8
+
+struct ms_ff_group {
+	struct config_group group;
+	struct mutex lock;		/* protects members, spread_ns */
+	char members[MS_FF_GROUP_MAX][32];
+	unsigned int nmembers;
+	u64 spread_ns;
+};
+
+static struct ms_ff_group *to_ms_ff_group(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct ms_ff_group, group);
+}
+
+static ssize_t ms_ff_group_members_show(struct config_item *item, char *page)
+{
+	struct ms_ff_group *g = to_ms_ff_group(item);
+	unsigned int i;
+	int len = 0;
+
+	mutex_lock(&g->lock);
+	for (i = 0; i < g->nmembers; i++)
+		len += sysfs_emit_at(page, len, "%s\n", g->members[i]);
+	mutex_unlock(&g->lock);
+
+	return len;
+}
+
+static ssize_t ms_ff_group_members_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct ms_ff_group *g = to_ms_ff_group(item);
+	char members[MS_FF_GROUP_MAX][32];
+	unsigned int n = 0;
+	char *buf, *spec, *tok;
+	int ret = count;
+
+	buf = kstrndup(page, count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	spec = buf;
+	while ((tok = strsep(&spec, " \t\n"))) {
+		if (!*tok)
+			continue;
+		if (n == MS_FF_GROUP_MAX ||
+		    strscpy(members[n], tok, sizeof(members[n])) < 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+		n++;
+	}
+
+	mutex_lock(&g->lock);
+	memcpy(g->members, members, sizeof(members));
+	g->nmembers = n;
+	mutex_unlock(&g->lock);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* called with ms_ff_lock held, so the gamepad stays */
+static void ms_ff_group_keep(struct ms_data *ms, u8 strong, u8 weak)
+{
+	struct ms_gamepad *gp = ms->gamepad;
+	unsigned long flags;
+
+	if (gp) {
+		spin_lock_irqsave(&gp->ff_lock, flags);
+		gp->strong = strong;
+		gp->weak = weak;
+		spin_unlock_irqrestore(&gp->ff_lock, flags);
+	}
+
+	spin_lock_irqsave(&ms->ff_lock, flags);
+	ms->strong = strong;
+	ms->weak = weak;
+	spin_unlock_irqrestore(&ms->ff_lock, flags);
+}
+
+static ssize_t ms_ff_group_trigger_store(struct config_item *item,
+		const char *page, size_t count)
+{
+	struct ms_ff_group *g = to_ms_ff_group(item);
+	struct hid_device *hdevs[MS_FF_GROUP_MAX];
+	unsigned int strong, weak, ms_duration = 0;
+	unsigned int i, n = 0;
+	struct xb1s_ff_report *r;
+	struct ms_data *ms;
+	u64 first = 0, last = 0;
+	u8 duration, loops;
+
+	if (sscanf(page, "%u %u %u", &strong, &weak, &ms_duration) < 2 ||
+	    strong > 100 || weak > 100)
+		return -EINVAL;
+
+	/* no duration plays until told otherwise, like the FF worker */
+	if (ms_duration) {
+		duration = min_t(unsigned int, DIV_ROUND_UP(ms_duration, 10),
+				 U8_MAX);
+		loops = 0;
+	} else {
+		duration = U8_MAX;
+		loops = U8_MAX;
+	}
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	ms_ff_fill(r, strong, weak, duration, loops);
+
+	mutex_lock(&g->lock);
+	/* hold ms_ff_lock so no member can be removed while sending */
+	mutex_lock(&ms_ff_lock);
+	list_for_each_entry(ms, &ms_ff_devices, ff_node) {
+		/* an open haptics ring has the motors */
+		if (READ_ONCE(ms->suspended) || READ_ONCE(ms->haptics_owned))
+			continue;
+		for (i = 0; i < g->nmembers; i++) {
+			if (!strcmp(dev_name(&ms->hdev->dev), g->members[i])) {
+				hdevs[n++] = ms->hdev;
+				break;
+			}
+		}
+	}
+
+	/* spread between the first and the last report going out */
+	for (i = 0; i < n; i++) {
+		last = ktime_get_ns();
+		if (!i)
+			first = last;
+
+		if (hid_hw_output_report(hdevs[i], (__u8 *)r, sizeof(*r)) < 0)
+			hid_warn(hdevs[i], "failed to send group FF report\n");
+
+		/*
+		 * The next FF worker run, resume and a reconnect start from
+		 * here, a timed rumble has stopped by then.
+		 */
+		ms_ff_group_keep(hid_get_drvdata(hdevs[i]),
+				 ms_duration ? 0 : strong,
+				 ms_duration ? 0 : weak);
+	}
+	if (n)
+		g->spread_ns = last - first;
+	mutex_unlock(&ms_ff_lock);
+	mutex_unlock(&g->lock);
+
+	kfree(r);
+
+	return n ? count : -ENODEV;
+}
+
+static ssize_t ms_ff_group_spread_ns_show(struct config_item *item,
+		char *page)
+{
+	struct ms_ff_group *g = to_ms_ff_group(item);
+	u64 spread;
+
+	mutex_lock(&g->lock);
+	spread = g->spread_ns;
+	mutex_unlock(&g->lock);
+
+	return sysfs_emit(page, "%llu\n", spread);
+}
+
+CONFIGFS_ATTR(ms_ff_group_, members);
+CONFIGFS_ATTR_WO(ms_ff_group_, trigger);
+CONFIGFS_ATTR_RO(ms_ff_group_, spread_ns);
+
+static struct configfs_attribute *ms_ff_group_attrs[] = {
+	&ms_ff_group_attr_members,
+	&ms_ff_group_attr_trigger,
+	&ms_ff_group_attr_spread_ns,
+	NULL,
+};
+
+static void ms_ff_group_release(struct config_item *item)
+{
+	kfree(to_ms_ff_group(item));
+}
+
+static struct configfs_item_operations ms_ff_group_item_ops = {
+	.release = ms_ff_group_release,
+};
+
+static const struct config_item_type ms_ff_group_type = {
+	.ct_item_ops = &ms_ff_group_item_ops,
+	.ct_attrs = ms_ff_group_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_group *ms_ff_group_make(struct config_group *parent,
+		const char *name)
+{
+	struct ms_ff_group *g;
+
+	g = kzalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&g->lock);
+	config_group_init_type_name(&g->group, name, &ms_ff_group_type);
+
+	return &g->group;
+}
+
+static struct configfs_group_operations ms_ff_groups_ops = {
+	.make_group = ms_ff_group_make,
+};
+
+static const struct config_item_type ms_ff_groups_type = {
+	.ct_group_ops = &ms_ff_groups_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem ms_ff_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = "hid-microsoft",
+			.ci_type = &ms_ff_groups_type,
+		},
+	},
+};
+
+static bool ms_ff_groups_registered;
+
+/* the driver works without groups, so a failure here is not fatal */
+static void ms_ff_groups_init(void)
+{
+	int ret;
+
+	config_group_init(&ms_ff_subsys.su_group);
+	mutex_init(&ms_ff_subsys.su_mutex);
+
+	ret = configfs_register_subsystem(&ms_ff_subsys);
+	if (ret) {
+		pr_warn("rumble groups unavailable: %d\n", ret);
+		return;
+	}
+	ms_ff_groups_registered = true;
+}
+
+static void ms_ff_groups_exit(void)
+{
+	if (ms_ff_groups_registered)
+		configfs_unregister_subsystem(&ms_ff_subsys);
+}
+
+#else
+
+static void ms_ff_groups_init(void)
+{
+}
+
+static void ms_ff_groups_exit(void)
+{
 }
 
+#endif /* IS_REACHABLE(CONFIG_CONFIGFS_FS) */
+
 static const struct hid_device_id ms_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_SIDEWINDER_GV),
 		.driver_data = MS_HIDINPUT },
@@ -467,7 +4284,7 @@ static const struct hid_device_id ms_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_WIRELESS_OPTICAL_DESKTOP_3_0),
 		.driver_data = MS_NOGET },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_COMFORT_MOUSE_4500),
-		.driver_data = MS_DUPLICATE_USAGES },
+		.driver_data = MS_DUPLICATE_USAGES | MS_MOUSE },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_POWER_COVER),
 		.driver_data = MS_HIDINPUT },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_COMFORT_KEYBOARD),
@@ -493,10 +4310,40 @@ static struct hid_driver ms_driver = {
 	.report_fixup = ms_report_fixup,
 	.input_mapping = ms_input_mapping,
 	.input_mapped = ms_input_mapped,
-	.event = ms_event,
+	.raw_event = ms_raw_event,
+	.report = ms_report,
 	.probe = ms_probe,
 	.remove = ms_remove,
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
-module_hid_driver(ms_driver);
+
+static int __init ms_init(void)
+{
+	int ret;
+
+	ms_rdesc_fixups_init();
+	ms_ff_groups_init();
+
+	ret = hid_register_driver(&ms_driver);
+	if (ret) {
+		ms_ff_groups_exit();
+		ms_rdesc_fixups_exit();
+	}
+
+	return ret;
+}
+
+static void __exit ms_exit(void)
+{
+	hid_unregister_driver(&ms_driver);
+	ms_ff_groups_exit();
+	ms_gamepads_exit();
+	ms_rdesc_fixups_exit();
+}
+
+module_init(ms_init);
+module_exit(ms_exit);
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * HID-BPF version of the Microsoft Wireless Receiver Model 1028 report
+ * descriptor fixup of hid-microsoft (ms_1028_patches): the consumer page
+ * collection declares Usage Minimum/Maximum where it means Physical
+ * Minimum/Maximum.
+ */
+
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#define VID_MICROSOFT		0x045E
+#define PID_LK6K		0x00F9
+
+#define LK6K_RDESC_SIZE		571
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, VID_MICROSOFT, PID_LK6K)
+);
+
+SEC(HID_BPF_RDESC_FIXUP)
+int BPF_PROG(lk6k_fix_rdesc, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, HID_MAX_DESCRIPTOR_SIZE);
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	/* like the driver, only touch the descriptor if both bytes match */
+	if (data[557] != 0x19 || data[559] != 0x29)
+		return 0;
+
+	data[557] = 0x35;	/* Physical Minimum */
+	data[559] = 0x45;	/* Physical Maximum */
+
+	return 0;
+}
+
+HID_BPF_OPS(microsoft_lk6k) = {
+	.hid_rdesc_fixup = (void *)lk6k_fix_rdesc,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	ctx->retval = ctx->rdesc_size != LK6K_RDESC_SIZE;
+	if (ctx->retval)
+		ctx->retval = -EINVAL;
+
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Per report button remap of Xbox controllers, the HID-BPF counterpart of
+ * the hid-microsoft remap attribute. It rewrites the buttons of input
+ * report 1 before any driver sees it, so it works with hid-microsoft,
+ * hid-microsoft-xbox and hid-generic alike.
+ *
+ * button_map[i] is the button that input button i is reported as, in
+ * report order (A, B, C, X, Y, Z, LB, RB, TL2, TR2, View, Menu, Guide,
+ * LS, RS). The default swaps A/B and X/Y, the same as writing
+ * "a=b b=a x=y y=x" to the remap attribute.
+ */
+
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#define VID_MICROSOFT		0x045E
+#define PID_XBOX_ONE_S		0x02FD
+#define PID_XBOX_SERIES_XS	0x0B13
+
+#define XBOX_INPUT_REPORT	1
+#define XBOX_BUTTONS_OFFSET	14	/* after the axes and the hat */
+#define XBOX_BUTTONS		15
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_BLUETOOTH, HID_GROUP_GENERIC, VID_MICROSOFT, PID_XBOX_ONE_S),
+	HID_DEVICE(BUS_BLUETOOTH, HID_GROUP_GENERIC, VID_MICROSOFT, PID_XBOX_SERIES_XS)
+);
+
+const volatile __u8 button_map[XBOX_BUTTONS] = {
+	1, 0, 2, 4, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+};
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(xbox_buttons_remap_event, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, XBOX_BUTTONS_OFFSET + 2);
+	__u16 in, out;
+	int i;
+
+	if (!data || data[0] != XBOX_INPUT_REPORT)
+		return 0; /* EPERM check */
+
+	in = data[XBOX_BUTTONS_OFFSET] | data[XBOX_BUTTONS_OFFSET + 1] << 8;
+	/* keep the padding bit */
+	out = in & ~((1 << XBOX_BUTTONS) - 1);
+
+	bpf_for(i, 0, XBOX_BUTTONS) {
+		if (in & (1 << i))
+			out |= 1 << (button_map[i] & 0x0f);
+	}
+
+	data[XBOX_BUTTONS_OFFSET] = out & 0xff;
+	data[XBOX_BUTTONS_OFFSET + 1] = out >> 8;
+
+	return 0;
+}
+
+HID_BPF_OPS(xbox_buttons_remap) = {
+	.hid_device_event = (void *)xbox_buttons_remap_event,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	ctx->retval = 0;
+
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
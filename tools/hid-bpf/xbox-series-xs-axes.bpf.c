@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * HID-BPF version of the Xbox Series X|S axis mapping of
+ * hid-microsoft-xbox (xbox_series_xs_mapping), for use with hid-generic:
+ * the right stick moves from Z/Rz to Rx/Ry and the triggers from the
+ * simulation page brake/accelerator to Z/Rz.
+ *
+ * The usages are rewritten in place, so the report layout and the cost
+ * of each report are unchanged. Other simulation page usages sharing the
+ * Usage Page item of the triggers would move to the generic desktop page
+ * as well; the controller firmwares seen so far have none.
+ */
+
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#define VID_MICROSOFT		0x045E
+#define PID_XBOX_SERIES_XS	0x0B13
+
+#define PAGE_GENERIC_DESKTOP	0x01
+#define PAGE_SIMULATION		0x02
+
+#define GD_Z			0x32
+#define GD_RX			0x33
+#define GD_RY			0x34
+#define GD_RZ			0x35
+#define SIM_ACCELERATOR		0xc4
+#define SIM_BRAKE		0xc5
+
+#define MAX_ITEMS		512
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_BLUETOOTH, HID_GROUP_GENERIC, VID_MICROSOFT, PID_XBOX_SERIES_XS)
+);
+
+SEC(HID_BPF_RDESC_FIXUP)
+int BPF_PROG(xbox_series_xs_fix_rdesc, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0 /* offset */, HID_MAX_DESCRIPTOR_SIZE);
+	__u32 i = 0, page = 0, page_at = 0;
+	__u8 item, len;
+	int n;
+
+	if (!data)
+		return 0; /* EPERM check */
+
+	/* short items only, the Xbox descriptors have no long ones */
+	bpf_for(n, 0, MAX_ITEMS) {
+		if (i >= hctx->size || i + 1 >= HID_MAX_DESCRIPTOR_SIZE)
+			break;
+
+		item = data[i];
+		len = item & 0x03;
+		if (len == 3)
+			len = 4;
+
+		if (item == 0x05) {		/* Usage Page, 1 byte */
+			page = data[i + 1];
+			page_at = i;
+		} else if (item == 0x09) {	/* Usage, 1 byte */
+			__u8 *usage = &data[i + 1];
+
+			if (page == PAGE_GENERIC_DESKTOP && *usage == GD_Z)
+				*usage = GD_RX;
+			else if (page == PAGE_GENERIC_DESKTOP && *usage == GD_RZ)
+				*usage = GD_RY;
+			else if (page == PAGE_SIMULATION &&
+				 (*usage == SIM_BRAKE || *usage == SIM_ACCELERATOR)) {
+				*usage = *usage == SIM_BRAKE ? GD_Z : GD_RZ;
+				if (page_at + 1 < HID_MAX_DESCRIPTOR_SIZE)
+					data[page_at + 1] = PAGE_GENERIC_DESKTOP;
+			}
+		}
+
+		i += 1 + len;
+	}
+
+	return 0;
+}
+
+HID_BPF_OPS(xbox_series_xs_axes) = {
+	.hid_rdesc_fixup = (void *)xbox_series_xs_fix_rdesc,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	ctx->retval = 0;
+
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Check the Surface Dial wheel conversion of hid-microsoft
+ *
+ * Feeds rotations through ms_dial_rotate() and compares the summed up
+ * REL_WHEEL_HI_RES and REL_WHEEL steps with what a user expects from the
+ * detents turned. Exits non-zero when a case fails.
+ *
+ *	make check
+ */
+
+#include <stdio.h>
+
+#include "../hid-microsoft-dial.h"
+
+/* the Surface Dial: 3600 units per turn, a detent every 10 degrees */
+#define UNITS_PER_DETENT	100
+
+struct dial_case {
+	const char *name;
+	int step;		/* dial units per report */
+	int reports;
+	int reverse;		/* reports before the direction changes */
+	int hires;		/* expected sums */
+	int wheel;
+};
+
+static const struct dial_case cases[] = {
+	{ "clockwise, one unit per report", 1, 300, 0, -360, -3 },
+	{ "counter-clockwise, one unit per report", -1, 300, 0, 360, 3 },
+	{ "clockwise, a detent per report", 100, 4, 0, -480, -4 },
+	{ "counter-clockwise, a detent per report", -100, 4, 0, 480, 4 },
+	{ "counter-clockwise, uneven steps", -7, 100, 0, 840, 7 },
+	/*
+	 * Half a detent one way, one and a half back: the half detent of
+	 * REL_WHEEL is dropped when the direction changes.
+	 */
+	{ "half a detent, then back", 1, 200, 50, 120, 1 },
+	{ "half a detent back, then clockwise", -1, 200, 50, -120, -1 },
+};
+
+static int run(const struct dial_case *c)
+{
+	struct ms_dial_remainder r = { 0 };
+	int hires = 0, wheel = 0;
+	int i, h, w, step;
+
+	for (i = 0; i < c->reports; i++) {
+		step = c->reverse && i >= c->reverse ? -c->step : c->step;
+		ms_dial_rotate(&r, step, UNITS_PER_DETENT, &h, &w);
+		hires += h;
+		wheel += w;
+	}
+
+	if (hires == c->hires && wheel == c->wheel) {
+		printf("ok   %s\n", c->name);
+		return 0;
+	}
+
+	printf("FAIL %s: hires %d wheel %d, expected %d %d\n", c->name,
+	       hires, wheel, c->hires, c->wheel);
+	return 1;
+}
+
+int main(void)
+{
+	unsigned int i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		failed += run(&cases[i]);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per report cost of an Xbox Series X|S controller, through uhid
+ *
+ * Creates a Bluetooth Xbox Series X|S controller on uhid, opens its
+ * input device so nothing is skipped as idle, then writes input reports
+ * and prints the system CPU time spent per report. The reports are
+ * delivered synchronously from write(), so the kernel's processing shows
+ * up as system time of this process.
+ *
+ * Compare the in-driver remap against the HID-BPF one:
+ *
+ *	./ms-uhid-bench -p "a=b b=a x=y y=x"
+ *	udev-hid-bpf install hid-bpf/xbox-buttons-remap.bpf.o
+ *	./ms-uhid-bench
+ *
+ * The BPF program only swaps the buttons in the report, hid-microsoft
+ * still decodes it in both runs. So this compares the two remaps, not
+ * HID-BPF against the driver; run it without either for the baseline.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_NAME	"Xbox Wireless Controller (uhid bench)"
+#define VID_MICROSOFT	0x045e
+#define PID_SERIES_XS	0x0b13
+
+/*
+ * xbox_series_xs_rdesc from hid-microsoft-xbox.h, with a vendor feature
+ * report appended so hid-microsoft takes it for a firmware descriptor and
+ * swaps in the canonical one like it does for a real controller.
+ */
+static const uint8_t bench_rdesc[] = {
+	0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x85, 0x01,
+	/* sticks */
+	0x09, 0x01, 0xa1, 0x00, 0x09, 0x30, 0x09, 0x31,
+	0x15, 0x00, 0x27, 0xff, 0xff, 0x00, 0x00, 0x95, 0x02,
+	0x75, 0x10, 0x81, 0x02, 0xc0,
+	0x09, 0x01, 0xa1, 0x00, 0x09, 0x32, 0x09, 0x35,
+	0x81, 0x02, 0xc0,
+	/* triggers */
+	0x05, 0x02, 0x09, 0xc5, 0x26, 0xff, 0x03, 0x95, 0x01,
+	0x75, 0x0a, 0x81, 0x02, 0x75, 0x06, 0x81, 0x03,
+	0x09, 0xc4, 0x75, 0x0a, 0x81, 0x02, 0x75, 0x06, 0x81, 0x03,
+	/* hat */
+	0x05, 0x01, 0x09, 0x39, 0x15, 0x01, 0x25, 0x08,
+	0x35, 0x00, 0x46, 0x3b, 0x01, 0x65, 0x14, 0x75, 0x04,
+	0x81, 0x42, 0x81, 0x03,
+	/* buttons */
+	0x15, 0x00, 0x25, 0x01, 0x45, 0x00, 0x65, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x0f, 0x75, 0x01, 0x95, 0x0f,
+	0x81, 0x02, 0x95, 0x01, 0x81, 0x03,
+	/* Series X|S padding byte */
+	0x75, 0x08, 0x81, 0x03,
+	/* rumble */
+	0x05, 0x0f, 0x09, 0x21, 0x85, 0x03, 0xa1, 0x02,
+	0x09, 0x97, 0x75, 0x04, 0x91, 0x02, 0x91, 0x03,
+	0x09, 0x70, 0x25, 0x64, 0x75, 0x08, 0x95, 0x04, 0x91, 0x02,
+	0x09, 0x50, 0x66, 0x01, 0x10, 0x55, 0x0e, 0x26, 0xff, 0x00,
+	0x95, 0x01, 0x91, 0x02, 0x09, 0xa7, 0x91, 0x02,
+	0x65, 0x00, 0x55, 0x00, 0x09, 0x7c, 0x91, 0x02, 0xc0,
+	/* battery */
+	0x05, 0x06, 0x09, 0x20, 0x85, 0x04, 0x81, 0x02,
+	/* vendor feature report, not part of the canonical descriptor */
+	0x06, 0x00, 0xff, 0x09, 0x01, 0x85, 0x10, 0xb1, 0x02,
+	0xc0,
+};
+
+/* input report 1, see struct xbox_input_report */
+struct bench_report {
+	uint8_t report_id;
+	uint16_t axes[4];
+	uint16_t brake;
+	uint16_t accelerator;
+	uint8_t hat;
+	uint16_t buttons;
+	uint8_t pad;
+} __attribute__((packed));
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+static int uhid_create(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, BENCH_NAME);
+	memcpy(ev.u.create2.rd_data, bench_rdesc, sizeof(bench_rdesc));
+	ev.u.create2.rd_size = sizeof(bench_rdesc);
+	ev.u.create2.bus = BUS_BLUETOOTH;
+	ev.u.create2.vendor = VID_MICROSOFT;
+	ev.u.create2.product = PID_SERIES_XS;
+
+	return uhid_write(fd, &ev);
+}
+
+/* wait for the driver to start the device */
+static int uhid_wait_start(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct uhid_event ev;
+
+	while (poll(&pfd, 1, 5000) > 0) {
+		if (read(fd, &ev, sizeof(ev)) <= 0)
+			return -errno;
+		if (ev.type == UHID_START)
+			return 0;
+	}
+
+	return -ETIMEDOUT;
+}
+
+static int evdev_open(char *node, size_t len)
+{
+	char path[280], name[256];
+	struct dirent *de;
+	int tries, fd;
+	DIR *dir;
+
+	/* udev may take a moment to create the node */
+	for (tries = 0; tries < 50; tries++) {
+		dir = opendir("/dev/input");
+		if (!dir)
+			return -errno;
+
+		while ((de = readdir(dir))) {
+			if (strncmp(de->d_name, "event", 5))
+				continue;
+
+			snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd < 0)
+				continue;
+
+			if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) > 0 &&
+			    !strcmp(name, BENCH_NAME)) {
+				snprintf(node, len, "%s", de->d_name);
+				closedir(dir);
+				return fd;
+			}
+			close(fd);
+		}
+		closedir(dir);
+		usleep(100000);
+	}
+
+	return -ENODEV;
+}
+
+/* the remap attribute of hid-microsoft, on the HID device */
+static int set_profile(const char *node, const char *profile)
+{
+	char path[512];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "/sys/class/input/%s/device/device/remap",
+		 node);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	ret = fputs(profile, f) < 0 ? -EIO : 0;
+	if (fclose(f))
+		ret = -errno;
+
+	return ret;
+}
+
+static void evdev_drain(int fd)
+{
+	struct input_event ev[64];
+
+	while (read(fd, ev, sizeof(ev)) > 0)
+		;
+}
+
+static uint64_t tv_ns(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n reports] [-p profile] [-r label]\n"
+		"  -n  number of input reports (default 100000)\n"
+		"  -p  hid-microsoft remap profile to load first\n"
+		"  -r  label printed with the results\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long reports = 100000, i;
+	const char *label = "default", *profile = NULL;
+	struct rusage before, after;
+	struct bench_report *r;
+	struct uhid_event ev;
+	uint64_t start, wall;
+	char node[256];
+	int fd, evfd, opt;
+
+	while ((opt = getopt(argc, argv, "n:p:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			reports = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			profile = optarg;
+			label = optarg;
+			break;
+		case 'r':
+			label = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+
+	if (uhid_create(fd) || uhid_wait_start(fd)) {
+		fprintf(stderr, "could not create the uhid device\n");
+		return 1;
+	}
+
+	evfd = evdev_open(node, sizeof(node));
+	if (evfd < 0) {
+		fprintf(stderr, "no input device for %s\n", BENCH_NAME);
+		return 1;
+	}
+
+	if (profile && set_profile(node, profile)) {
+		fprintf(stderr, "could not load the remap profile, is hid-microsoft bound?\n");
+		return 1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = sizeof(*r);
+	r = (struct bench_report *)ev.u.input2.data;
+	r->report_id = 1;
+
+	getrusage(RUSAGE_SELF, &before);
+	start = now_ns();
+
+	for (i = 0; i < reports; i++) {
+		/* move a stick and a trigger, toggle A and X */
+		r->axes[0] = 0x8000 + (i & 0xff) * 64;
+		r->brake = i & 0x3ff;
+		r->buttons = (i & 1) | (i & 2) << 2;
+
+		if (uhid_write(fd, &ev)) {
+			perror("uhid write");
+			return 1;
+		}
+
+		/* keep the evdev client from overflowing */
+		if (!(i % 32))
+			evdev_drain(evfd);
+	}
+
+	wall = now_ns() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	printf("%s: %lu reports, %.0f ns system, %.0f ns user, %.0f ns wall per report\n",
+	       label, reports,
+	       (double)(tv_ns(&after.ru_stime) - tv_ns(&before.ru_stime)) / reports,
+	       (double)(tv_ns(&after.ru_utime) - tv_ns(&before.ru_utime)) / reports,
+	       (double)wall / reports);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+
+	close(evfd);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,634 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Replay a controller through uhid over an impaired Bluetooth link
+ *
+ * Creates the device of a hid-recorder capture on uhid and replays its
+ * input reports with the link impairments given on the command line.
+ * It also stands in for the controller end of the output path: output
+ * reports (rumble) are logged with the time they arrived, SET_REPORT and
+ * GET_REPORT requests are answered after a configurable delay.
+ *
+ *	hid-recorder /dev/hidraw3 > series-xs.hid
+ *	./ms-uhid-link -j 4000 -s 500:40 -d 1 -S 7 series-xs.hid
+ *
+ * The random impairments use their own generator seeded with -S, so a
+ * run can be repeated exactly.
+ *
+ * uhid adds the device asynchronously, so the replay clock only starts
+ * once the driver has started it, or with -O once something opened it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_SUFFIX	" (uhid link)"
+#define PENDING_MAX	16
+#define READY_TIMEOUT_MS	5000
+
+struct report {
+	uint64_t due_ns;	/* from the start of the loop */
+	uint16_t size;
+	uint8_t data[UHID_DATA_MAX];
+};
+
+struct capture {
+	char name[128];
+	uint16_t bus;
+	uint32_t vendor, product;
+	uint16_t rd_size;
+	uint8_t rd_data[HID_MAX_DESCRIPTOR_SIZE];
+	struct report *reports;
+	size_t nreports;
+};
+
+struct impairment {
+	unsigned int jitter_us;		/* extra delay, uniform 0..jitter */
+	unsigned int drop_pct;
+	unsigned int reorder_pct;	/* swap with the next report */
+	unsigned int burst;		/* reports delivered back to back */
+	unsigned int stall_period_ms;
+	unsigned int stall_ms;		/* held, then delivered at once */
+};
+
+/* GET_REPORT/SET_REPORT answered once due */
+struct pending {
+	uint64_t due_ns;
+	uint32_t id;
+	uint32_t type;
+};
+
+/* as told by UHID_START/STOP and UHID_OPEN/CLOSE */
+struct device_state {
+	bool started;
+	bool opened;
+};
+
+struct stats {
+	unsigned long sent, dropped, reordered, stalled;
+	unsigned long outputs, set_reports, get_reports;
+	uint64_t last_output_ns;
+};
+
+static uint64_t rng_state;
+
+/* splitmix64, small and the same everywhere */
+static uint64_t rng_next(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static unsigned int rng_below(unsigned int n)
+{
+	return n ? rng_next() % n : 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t parse_bytes(char *s, uint8_t *out, size_t max)
+{
+	size_t n = 0;
+	char *end;
+
+	while (n < max) {
+		unsigned long v = strtoul(s, &end, 16);
+
+		if (end == s)
+			break;
+		out[n++] = v;
+		s = end;
+	}
+
+	return n;
+}
+
+/* the N:, I:, R: and E: lines of the hid-recorder format */
+static int capture_load(const char *path, struct capture *c)
+{
+	char line[4096], *p;
+	unsigned long sec, usec;
+	unsigned int len;
+	struct report *r;
+	size_t alloc = 0;
+	int off;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		if (!strncmp(line, "N: ", 3)) {
+			snprintf(c->name, sizeof(c->name), "%.100s", line + 3);
+		} else if (!strncmp(line, "I: ", 3)) {
+			unsigned int bus;
+
+			if (sscanf(line + 3, "%x %x %x", &bus, &c->vendor,
+				   &c->product) != 3)
+				goto err_format;
+			c->bus = bus;
+		} else if (!strncmp(line, "R: ", 3)) {
+			if (sscanf(line + 3, "%u%n", &len, &off) != 1)
+				goto err_format;
+			p = line + 3 + off;
+			c->rd_size = parse_bytes(p, c->rd_data,
+						 sizeof(c->rd_data));
+			if (c->rd_size != len)
+				goto err_format;
+		} else if (!strncmp(line, "E: ", 3)) {
+			if (sscanf(line + 3, "%lu.%lu %u%n", &sec, &usec, &len,
+				   &off) != 3)
+				goto err_format;
+
+			if (c->nreports == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				r = realloc(c->reports, alloc * sizeof(*r));
+				if (!r) {
+					fclose(f);
+					return -ENOMEM;
+				}
+				c->reports = r;
+			}
+
+			r = &c->reports[c->nreports];
+			r->due_ns = sec * 1000000000ULL + usec * 1000ULL;
+			r->size = parse_bytes(line + 3 + off, r->data,
+					      sizeof(r->data));
+			if (r->size != len)
+				goto err_format;
+			c->nreports++;
+		}
+	}
+
+	fclose(f);
+	return c->rd_size && c->nreports ? 0 : -ENODATA;
+
+err_format:
+	fprintf(stderr, "%s: malformed line: %s\n", path, line);
+	fclose(f);
+	return -EINVAL;
+}
+
+/*
+ * Apply the impairments to one pass over the capture, into @out. Delivery
+ * stays in order like on L2CAP, jitter only ever delays a report and the
+ * ones behind it; reordering is a separate, explicit model.
+ */
+static size_t impair(const struct capture *c, struct report *out,
+		     const struct impairment *im, struct stats *st)
+{
+	uint64_t due, prev = 0, stall_period, stall_len, phase;
+	size_t i, n = 0, group = 0;
+
+	stall_period = im->stall_period_ms * 1000000ULL;
+	stall_len = im->stall_ms * 1000000ULL;
+
+	for (i = 0; i < c->nreports; i++) {
+		if (rng_below(100) < im->drop_pct) {
+			st->dropped++;
+			continue;
+		}
+
+		due = c->reports[i].due_ns - c->reports[0].due_ns;
+		due += rng_below(im->jitter_us + 1) * 1000ULL;
+
+		if (stall_period && stall_len) {
+			phase = due % stall_period;
+			if (phase < stall_len) {
+				due += stall_len - phase;
+				st->stalled++;
+			}
+		}
+
+		if (due < prev)
+			due = prev;
+		prev = due;
+
+		out[n] = c->reports[i];
+		out[n].due_ns = due;
+
+		/* a burst goes out when its last report is due */
+		if (im->burst > 1) {
+			if (++group == im->burst) {
+				size_t j;
+
+				for (j = n + 1 - group; j < n; j++)
+					out[j].due_ns = due;
+				group = 0;
+			}
+		}
+		n++;
+	}
+
+	/* an incomplete last burst goes out as it is */
+
+	/* swap the payloads, the delivery times stay */
+	for (i = 0; i + 1 < n; i++) {
+		if (rng_below(100) < im->reorder_pct) {
+			struct report tmp = out[i];
+
+			out[i] = out[i + 1];
+			out[i].due_ns = tmp.due_ns;
+			tmp.due_ns = out[i + 1].due_ns;
+			out[i + 1] = tmp;
+			st->reordered++;
+			i++;
+		}
+	}
+
+	return n;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+static int uhid_create(int fd, const struct capture *c)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "%s%s", c->name, NAME_SUFFIX);
+	memcpy(ev.u.create2.rd_data, c->rd_data, c->rd_size);
+	ev.u.create2.rd_size = c->rd_size;
+	ev.u.create2.bus = c->bus;
+	ev.u.create2.vendor = c->vendor;
+	ev.u.create2.product = c->product;
+
+	return uhid_write(fd, &ev);
+}
+
+static int send_input(int fd, const struct report *r)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = r->size;
+	memcpy(ev.u.input2.data, r->data, r->size);
+
+	return uhid_write(fd, &ev);
+}
+
+static int send_reply(int fd, const struct pending *p)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = p->type;
+	if (p->type == UHID_SET_REPORT_REPLY) {
+		ev.u.set_report_reply.id = p->id;
+	} else {
+		/* no feature data in a capture */
+		ev.u.get_report_reply.id = p->id;
+		ev.u.get_report_reply.err = EIO;
+	}
+
+	return uhid_write(fd, &ev);
+}
+
+static void print_output(const uint8_t *data, size_t size, uint64_t t,
+			 struct stats *st)
+{
+	size_t i;
+
+	printf("output %10.3f ms (+%8.3f ms):", t / 1e6,
+	       st->outputs ? (t - st->last_output_ns) / 1e6 : 0.0);
+	for (i = 0; i < size; i++)
+		printf(" %02x", data[i]);
+	printf("\n");
+
+	st->outputs++;
+	st->last_output_ns = t;
+}
+
+/* handle what the kernel sent, queueing replies that are due later */
+static int uhid_read(int fd, uint64_t start, unsigned int reply_us,
+		     struct pending *pending, size_t *npending,
+		     struct device_state *ds, struct stats *st)
+{
+	struct uhid_event ev;
+	struct pending *p;
+	ssize_t ret;
+
+	ret = read(fd, &ev, sizeof(ev));
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	switch (ev.type) {
+	case UHID_START:
+		ds->started = true;
+		break;
+	case UHID_STOP:
+		ds->started = false;
+		break;
+	case UHID_OPEN:
+		ds->opened = true;
+		break;
+	case UHID_CLOSE:
+		ds->opened = false;
+		break;
+	case UHID_OUTPUT:
+		print_output(ev.u.output.data, ev.u.output.size,
+			     now_ns() - start, st);
+		break;
+	case UHID_SET_REPORT:
+	case UHID_GET_REPORT:
+		if (*npending == PENDING_MAX) {
+			fprintf(stderr, "too many requests in flight\n");
+			return -ENOSPC;
+		}
+		p = &pending[(*npending)++];
+		p->due_ns = now_ns() + reply_us * 1000ULL;
+		if (ev.type == UHID_SET_REPORT) {
+			p->id = ev.u.set_report.id;
+			p->type = UHID_SET_REPORT_REPLY;
+			st->set_reports++;
+		} else {
+			p->id = ev.u.get_report.id;
+			p->type = UHID_GET_REPORT_REPLY;
+			st->get_reports++;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static int flush_replies(int fd, struct pending *pending, size_t *npending,
+			 uint64_t now)
+{
+	size_t i = 0;
+	int ret;
+
+	while (i < *npending) {
+		if (pending[i].due_ns > now) {
+			i++;
+			continue;
+		}
+		ret = send_reply(fd, &pending[i]);
+		if (ret)
+			return ret;
+		pending[i] = pending[--(*npending)];
+	}
+
+	return 0;
+}
+
+static int next_timeout(uint64_t due, const struct pending *pending,
+			size_t npending, uint64_t now)
+{
+	size_t i;
+
+	for (i = 0; i < npending; i++)
+		if (pending[i].due_ns < due)
+			due = pending[i].due_ns;
+
+	if (due <= now)
+		return 0;
+	/* round up, poll() must not wake early */
+	return (due - now + 999999) / 1000000;
+}
+
+/*
+ * Wait for the driver to start the device and, with @need_open, for
+ * something to open it, answering requests made while probing.
+ */
+static int wait_ready(int fd, uint64_t start, unsigned int reply_us,
+		      bool need_open, struct pending *pending, size_t *npending,
+		      struct device_state *ds, struct stats *st)
+{
+	uint64_t deadline = now_ns() + READY_TIMEOUT_MS * 1000000ULL, now;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ret;
+
+	while (!ds->started || (need_open && !ds->opened)) {
+		now = now_ns();
+		if (now >= deadline)
+			return -ETIMEDOUT;
+
+		ret = flush_replies(fd, pending, npending, now);
+		if (ret)
+			return ret;
+
+		ret = poll(&pfd, 1, next_timeout(deadline, pending, *npending,
+						 now));
+		if (ret < 0)
+			return -errno;
+		if (ret) {
+			ret = uhid_read(fd, start, reply_us, pending, npending,
+					ds, st);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] <hid-recorder capture>\n"
+		"  -j us        jitter, extra delay of up to us per report\n"
+		"  -d pct       drop reports\n"
+		"  -o pct       swap a report with the next one\n"
+		"  -b n         deliver n reports back to back\n"
+		"  -s ms:ms     stall the link for the second ms every first ms\n"
+		"  -c us        delay of SET_REPORT/GET_REPORT replies\n"
+		"  -l n         replay the capture n times (default 1)\n"
+		"  -S seed      seed of the impairments (default 1)\n"
+		"  -O           start once the device is opened, not started\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct impairment im = { 0 };
+	struct pending pending[PENDING_MAX];
+	unsigned int reply_us = 0, loops = 1, loop;
+	size_t npending = 0, n, i;
+	struct capture c = { .name = "capture" };
+	struct device_state ds = { 0 };
+	struct stats st = { 0 };
+	bool need_open = false;
+	struct report *out;
+	uint64_t start, base, now;
+	struct pollfd pfd;
+	int fd, opt, ret;
+
+	rng_state = 1;
+
+	while ((opt = getopt(argc, argv, "j:d:o:b:s:c:l:S:Oh")) != -1) {
+		switch (opt) {
+		case 'j':
+			im.jitter_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			im.drop_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			im.reorder_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			im.burst = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%u:%u", &im.stall_period_ms,
+				   &im.stall_ms) != 2 ||
+			    im.stall_ms >= im.stall_period_ms) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'c':
+			reply_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			rng_state = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			need_open = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = capture_load(argv[optind], &c);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	out = calloc(c.nreports, sizeof(*out));
+	if (!out) {
+		perror("calloc");
+		return 1;
+	}
+
+	fd = open("/dev/uhid", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+
+	if (uhid_create(fd, &c)) {
+		fprintf(stderr, "could not create the uhid device\n");
+		return 1;
+	}
+
+	/* reports sent before the driver is ready are lost */
+	start = now_ns();
+	ret = wait_ready(fd, start, reply_us, need_open, pending, &npending,
+			 &ds, &st);
+	if (ret) {
+		fprintf(stderr, "device not %s: %s\n",
+			ds.started ? "opened" : "started", strerror(-ret));
+		return 1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	base = now_ns();
+
+	for (loop = 0; loop < loops; loop++) {
+		n = impair(&c, out, &im, &st);
+
+		for (i = 0; i < n; ) {
+			now = now_ns();
+			ret = flush_replies(fd, pending, &npending, now);
+			if (ret)
+				goto err_io;
+
+			/* everything due goes out back to back */
+			while (i < n && base + out[i].due_ns <= now) {
+				ret = send_input(fd, &out[i++]);
+				if (ret)
+					goto err_io;
+				st.sent++;
+			}
+			if (i == n)
+				break;
+
+			ret = poll(&pfd, 1, next_timeout(base + out[i].due_ns,
+							 pending, npending,
+							 now));
+			if (ret < 0) {
+				ret = -errno;
+				goto err_io;
+			}
+			if (ret)
+				ret = uhid_read(fd, start, reply_us, pending,
+						&npending, &ds, &st);
+			if (ret < 0)
+				goto err_io;
+		}
+
+		base = now_ns();
+	}
+
+	/* answer what is still in flight */
+	while (npending) {
+		now = now_ns();
+		ret = poll(&pfd, 1, next_timeout(UINT64_MAX, pending, npending,
+						 now));
+		if (ret > 0)
+			uhid_read(fd, start, reply_us, pending, &npending, &ds,
+				  &st);
+		ret = flush_replies(fd, pending, &npending, now_ns());
+		if (ret)
+			goto err_io;
+	}
+
+	printf("%lu sent, %lu dropped, %lu reordered, %lu stalled, %lu outputs, %lu set_report, %lu get_report\n",
+	       st.sent, st.dropped, st.reordered, st.stalled, st.outputs,
+	       st.set_reports, st.get_reports);
+
+	close(fd);
+	free(out);
+	free(c.reports);
+
+	return 0;
+
+err_io:
+	fprintf(stderr, "uhid: %s\n", strerror(-ret));
+	return 1;
+}